@@ -0,0 +1,18 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+int
+main(void)
+{
+  struct bcstat st;
+
+  if(bcstat(&st) < 0){
+    printf(2, "bcstat failed\n");
+    exit();
+  }
+  printf(1, "buffers %d (in %d, main %d)\n", st.nbuf, st.nin, st.nmain);
+  printf(1, "hits %d misses %d (%d reused after eviction)\n",
+         st.hits, st.misses, st.ghosthits);
+  exit();
+}
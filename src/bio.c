@@ -1,12 +1,14 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
+// * To get a run of them, call bgetn, then bfill those whose
+//     old contents are needed.
 // * After changing buffer data, call bwrite to write it to disk.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
@@ -19,41 +21,370 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+//
+// Buffers are found by hashing (dev, blockno) into one of NBUCKET
+// chains, each with its own lock, so lookups of different blocks
+// don't contend.
+//
+// Replacement follows 2Q, so that one pass over a large file
+// can't flush the blocks that are used over and over (inodes,
+// bitmap, directories).  A block read for the first time goes on
+// the "in" queue, a FIFO that holds about a quarter of the
+// buffers; hits there don't count, since they are usually the
+// same read() touching a block a few times.  When a block falls
+// off the in queue its number is remembered on the "out" list of
+// ghosts.  A block that misses again while it still has a ghost
+// has shown it is reused, and goes on the "main" queue, which is
+// managed by the clock algorithm: brelse sets B_REF, and the clock
+// hand clears B_REF as it passes and takes the first clean, unused
+// buffer without it.  A sequential scan only ever cycles through
+// the in queue.
+//
+// bcache.lock protects the queues, the hand, and the ghosts,
+// and serializes misses; it is taken before any bucket lock.
+//
+// The number of buffers is chosen at boot from the amount of
+// physical memory, and raised at mount if the log needs it.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "spinlock.h"
 #include "fs.h"
 #include "buf.h"
+#include "stat.h"
+
+#define NBUCKET 1031  // hash chains (prime)
+#define BUFMEM  64    // use 1/BUFMEM of physical memory for buffers
+
+#define HASH(dev, blockno) (((dev)*31 + (blockno)) % NBUCKET)
+
+// A block recently evicted from the in queue.
+struct ghost {
+  uint dev;
+  uint blockno;
+  struct ghost *hnext;  // hash chain
+  struct ghost *next;   // ring, oldest first from bcache.ghand
+};
+
+struct bucket {
+  struct spinlock lock;
+  struct buf *head;      // chain through hnext
+  struct ghost *ghosts;  // protected by bcache.lock
+  uint hits;
+};
+
+// Ring of buffers through prev/next, starting at head.
+struct queue {
+  struct buf *head;
+  int n;
+};
 
 struct {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct kmem_cache *cache;
+  int nbuf;
 
-  // Linked list of all buffers, through prev/next.
-  // head.next is most recently used.
-  struct buf head;
+  struct queue in;    // FIFO; head is the oldest
+  struct queue main;  // clock; head is the hand
+  int maxin;          // target length of the in queue
+
+  struct ghost *ghand;
+  uint misses;
+  uint ghosthits;
+
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+static void
+qappend(struct queue *q, struct buf *b)
+{
+  if(q->head == 0){
+    b->next = b->prev = b;
+    q->head = b;
+  } else {
+    b->next = q->head;
+    b->prev = q->head->prev;
+    b->prev->next = b;
+    b->next->prev = b;
+  }
+  b->q = q;
+  q->n++;
+}
+
+static void
+qremove(struct buf *b)
+{
+  struct queue *q;
+
+  q = b->q;
+  if(b->next == b)
+    q->head = 0;
+  else {
+    if(q->head == b)
+      q->head = b->next;
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+  }
+  b->q = 0;
+  q->n--;
+}
+
+// Add up to n buffers to the in queue, fewer if memory
+// runs out.  Returns how many were added.
+static int
+baddbufs(int n)
+{
+  struct buf *b;
+  uchar *data;
+  int i;
+
+  data = 0;
+  for(i = 0; i < n; i++){
+    if(i % (PGSIZE/BSIZE) == 0 && (data = (uchar*)kalloc()) == 0)
+      break;
+    if((b = kmem_cache_alloc(bcache.cache)) == 0)
+      break;
+    memset(b, 0, sizeof(*b));
+    b->dev = -1;
+    b->data = data + (i % (PGSIZE/BSIZE))*BSIZE;
+    acquire(&bcache.lock);
+    qappend(&bcache.in, b);
+    bcache.nbuf++;
+    bcache.maxin = bcache.nbuf / 4;
+    release(&bcache.lock);
+  }
+  return i;
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  struct kmem_cache *gc;
+  struct ghost *g;
+  int i, n;
 
   initlock(&bcache.lock, "bcache");
+  for(i = 0; i < NBUCKET; i++)
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+  if((bcache.cache = kmem_cache_create("buf", sizeof(struct buf))) == 0)
+    panic("binit");
 
 //PAGEBREAK!
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    b->dev = -1;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  // Put the buffers on the in queue, so that they are
+  // used before anything is evicted.  initlog() adds more
+  // if the log can pin too many of them.
+  n = phystop / BUFMEM / BSIZE;
+  if(n < NBUF)
+    n = NBUF;
+  if(baddbufs(n) < NBUF)
+    panic("binit: out of memory");
+
+  // Remember half as many evicted blocks as there are buffers.
+  if((gc = kmem_cache_create("bghost", sizeof(*g))) == 0)
+    panic("binit");
+  for(i = 0; i < bcache.nbuf / 2; i++){
+    if((g = kmem_cache_alloc(gc)) == 0)
+      break;
+    g->dev = -1;
+    g->hnext = 0;
+    if(bcache.ghand == 0)
+      g->next = g;
+    else {
+      g->next = bcache.ghand->next;
+      bcache.ghand->next = g;
+    }
+    bcache.ghand = g;
+  }
+}
+
+// The log keeps up to npinned blocks it has written in the
+// cache until it installs them.  Make sure there are still
+// NBUF buffers beyond those for everything else.
+void
+breserve(int npinned)
+{
+  int n;
+
+  n = npinned + NBUF - bcache.nbuf;
+  if(n > 0 && baddbufs(n) < n)
+    panic("breserve: out of memory");
+}
+
+static struct bucket*
+bucket(uint dev, uint blockno)
+{
+  return &bcache.bucket[HASH(dev, blockno)];
+}
+
+// Record that (dev, blockno) was evicted from the in queue,
+// forgetting the oldest ghost.  Caller must hold bcache.lock.
+static void
+ghostadd(uint dev, uint blockno)
+{
+  struct ghost *g, **pp;
+  struct bucket *gb;
+
+  if((g = bcache.ghand) == 0)
+    return;
+  bcache.ghand = g->next;
+  if(g->dev != -1){
+    gb = bucket(g->dev, g->blockno);
+    for(pp = &gb->ghosts; *pp != g; pp = &(*pp)->hnext)
+      ;
+    *pp = g->hnext;
+  }
+  g->dev = dev;
+  g->blockno = blockno;
+  gb = bucket(dev, blockno);
+  g->hnext = gb->ghosts;
+  gb->ghosts = g;
+}
+
+// If (dev, blockno) has a ghost, remove it and return 1.
+// Caller must hold bcache.lock.
+static int
+ghostfind(uint dev, uint blockno)
+{
+  struct ghost *g, **pp;
+
+  for(pp = &bucket(dev, blockno)->ghosts; (g = *pp) != 0; pp = &g->hnext){
+    if(g->dev == dev && g->blockno == blockno){
+      *pp = g->hnext;
+      g->dev = -1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Try to take b for reuse: b must be clean and unused, and
+// if useref is set, not recently used.  On success, remove b
+// from its hash chain and return 1.  bk is the bucket the caller
+// holds locked.  Caller must hold bcache.lock.
+static int
+evict(struct buf *b, struct bucket *bk, int useref)
+{
+  struct bucket *hb;
+  struct buf **pp;
+  int ok;
+
+  // "clean" because B_DIRTY and !B_BUSY means log.c
+  // hasn't yet committed the changes to the buffer.
+  if(b->flags & (B_BUSY|B_DIRTY))
+    return 0;
+  if(b->dev == -1)
+    return 1;
+  // Only we rename buffers, so b->dev and b->blockno
+  // can't change under us; b->flags can.
+  hb = bucket(b->dev, b->blockno);
+  if(hb != bk)
+    acquire(&hb->lock);
+  ok = 0;
+  if(b->flags & (B_BUSY|B_DIRTY))
+    ;
+  else if(useref && (b->flags & B_REF))
+    b->flags &= ~B_REF;
+  else {
+    for(pp = &hb->head; *pp != b; pp = &(*pp)->hnext)
+      ;
+    *pp = b->hnext;
+    ok = 1;
+  }
+  if(hb != bk)
+    release(&hb->lock);
+  return ok;
+}
+
+// Take the oldest evictable buffer from the in queue.
+static struct buf*
+evictin(struct bucket *bk)
+{
+  struct buf *b;
+  int i;
+
+  b = bcache.in.head;
+  for(i = 0; i < bcache.in.n; i++, b = b->next){
+    if(evict(b, bk, 0)){
+      if(b->dev != -1)
+        ghostadd(b->dev, b->blockno);
+      return b;
+    }
+  }
+  return 0;
+}
+
+// Run the clock over the main queue.  Two trips around:
+// the first may only clear B_REF bits.
+static struct buf*
+evictmain(struct bucket *bk)
+{
+  struct buf *b;
+  int i;
+
+  for(i = 0; i < 2*bcache.main.n; i++){
+    b = bcache.main.head;
+    bcache.main.head = b->next;
+    if(evict(b, bk, 1))
+      return b;
   }
+  return 0;
+}
+
+// Recycle a clean, unused buffer for block (dev, blockno),
+// which is not cached.  Returns a B_BUSY buffer, or 0 if
+// someone else cached the block in the meantime.  If every
+// buffer is in use, panics, or returns 0 if canfail is set.
+static struct buf*
+brecycle(uint dev, uint blockno, int canfail)
+{
+  struct bucket *bk;
+  struct buf *b;
+  struct queue *q;
+
+  acquire(&bcache.lock);
+  bk = bucket(dev, blockno);
+  acquire(&bk->lock);
+  for(b = bk->head; b; b = b->hnext){
+    if(b->dev == dev && b->blockno == blockno){
+      release(&bk->lock);
+      release(&bcache.lock);
+      return 0;
+    }
+  }
+
+  b = 0;
+  if(bcache.in.n > bcache.maxin)
+    b = evictin(bk);
+  if(b == 0)
+    b = evictmain(bk);
+  if(b == 0)
+    b = evictin(bk);
+  if(b == 0){
+    if(!canfail)
+      panic("bget: no buffers");
+    release(&bk->lock);
+    release(&bcache.lock);
+    return 0;
+  }
+
+  bcache.misses++;
+  q = &bcache.in;
+  if(ghostfind(dev, blockno)){
+    bcache.ghosthits++;
+    q = &bcache.main;
+  }
+  qremove(b);
+  qappend(q, b);
+  b->dev = dev;
+  b->blockno = blockno;
+  b->flags = B_BUSY;
+  b->hnext = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  release(&bcache.lock);
+  return b;
 }
 
 // Look through buffer cache for block on device dev.
@@ -62,37 +393,93 @@ binit(void)
 static struct buf*
 bget(uint dev, uint blockno)
 {
+  struct bucket *bk;
   struct buf *b;
 
-  acquire(&bcache.lock);
+  bk = bucket(dev, blockno);
+  for(;;){
+    acquire(&bk->lock);
 
- loop:
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      if(!(b->flags & B_BUSY)){
-        b->flags |= B_BUSY;
-        release(&bcache.lock);
-        return b;
+   loop:
+    // Is the block already cached?
+    for(b = bk->head; b; b = b->hnext){
+      if(b->dev == dev && b->blockno == blockno){
+        if(!(b->flags & B_BUSY)){
+          b->flags |= B_BUSY;
+          bk->hits++;
+          release(&bk->lock);
+          return b;
+        }
+        sleep(b, &bk->lock);
+        goto loop;
       }
-      sleep(b, &bcache.lock);
-      goto loop;
     }
-  }
+    release(&bk->lock);
 
-  // Not cached; recycle some non-busy and clean buffer.
-  // "clean" because B_DIRTY and !B_BUSY means log.c
-  // hasn't yet committed the changes to the buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if((b->flags & B_BUSY) == 0 && (b->flags & B_DIRTY) == 0){
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = B_BUSY;
-      release(&bcache.lock);
+    // Not cached; recycle some non-busy and clean buffer.
+    if((b = brecycle(dev, blockno, 0)) != 0)
       return b;
-    }
   }
-  panic("bget: no buffers");
+}
+
+// Start I/O on n B_BUSY bufs, all for the same device, and
+// return without waiting: write those that are B_DIRTY, read
+// the others.  The disk driver can work on all of them at once.
+// Use bwait() to wait for them, unless B_ASYNC is set, in which
+// case each buf is released when its I/O is done.
+void
+bsubmit(struct buf **bufs, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(!(bufs[i]->flags & B_BUSY))
+      panic("bsubmit: buf not busy");
+    if((bufs[i]->flags & (B_VALID|B_DIRTY)) == B_VALID)
+      panic("bsubmit: nothing to do");
+    if(bufs[i]->dev != bufs[0]->dev)
+      panic("bsubmit: mixed devices");
+  }
+  idesubmit(bufs, n);
+}
+
+// Wait for the I/O started by bsubmit() on bufs to finish.
+void
+bwait(struct buf **bufs, int n)
+{
+  struct bucket *bk;
+  struct buf *b;
+  int i;
+
+  for(i = 0; i < n; i++){
+    b = bufs[i];
+    bk = bucket(b->dev, b->blockno);
+    acquire(&bk->lock);
+    while((b->flags & (B_VALID|B_DIRTY)) != B_VALID)
+      sleep(b, &bk->lock);
+    release(&bk->lock);
+  }
+}
+
+// Called by the disk driver, maybe from an interrupt,
+// when the I/O on b is done.
+void
+biodone(struct buf *b)
+{
+  struct bucket *bk;
+
+  if(b->flags & B_ASYNC){
+    b->flags &= ~(B_ASYNC|B_DIRTY);
+    b->flags |= B_VALID;
+    brelse(b);
+    return;
+  }
+  bk = bucket(b->dev, b->blockno);
+  acquire(&bk->lock);
+  b->flags &= ~B_DIRTY;
+  b->flags |= B_VALID;
+  wakeup(b);
+  release(&bk->lock);
 }
 
 // Return a B_BUSY buf with the contents of the indicated block.
@@ -103,11 +490,70 @@ bread(uint dev, uint blockno)
 
   b = bget(dev, blockno);
   if(!(b->flags & B_VALID)) {
-    iderw(b);
+    bsubmit(&b, 1);
+    bwait(&b, 1);
   }
   return b;
 }
 
+// Return B_BUSY bufs for the n blocks in blocknos, in
+// order, without reading them.  Use bfill() to read the
+// ones the caller doesn't overwrite whole.
+void
+bgetn(uint dev, uint *blocknos, struct buf **bufs, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    bufs[i] = bget(dev, blocknos[i]);
+}
+
+// Read the blocks of the n B_BUSY bufs that aren't valid,
+// handing them all to the disk driver at once, and wait.
+void
+bfill(struct buf **bufs, int n)
+{
+  struct buf *rd[NRUN];
+  int i, nr;
+
+  if(n > NRUN)
+    panic("bfill");
+  nr = 0;
+  for(i = 0; i < n; i++)
+    if(!(bufs[i]->flags & B_VALID))
+      rd[nr++] = bufs[i];
+  if(nr > 0){
+    bsubmit(rd, nr);
+    bwait(rd, nr);
+  }
+}
+
+// Start reading the indicated block into the cache, if it
+// isn't there already, and don't wait for it.  The buffer
+// is released when the read completes.
+// Gives up quietly if all buffers are in use.
+void
+breadahead(uint dev, uint blockno)
+{
+  struct bucket *bk;
+  struct buf *b;
+
+  bk = bucket(dev, blockno);
+  acquire(&bk->lock);
+  for(b = bk->head; b; b = b->hnext){
+    if(b->dev == dev && b->blockno == blockno){
+      release(&bk->lock);
+      return;
+    }
+  }
+  release(&bk->lock);
+
+  if((b = brecycle(dev, blockno, 1)) == 0)
+    return;
+  b->flags |= B_ASYNC;
+  bsubmit(&b, 1);
+}
+
 // Write b's contents to disk.  Must be B_BUSY.
 void
 bwrite(struct buf *b)
@@ -115,31 +561,46 @@ bwrite(struct buf *b)
   if((b->flags & B_BUSY) == 0)
     panic("bwrite");
   b->flags |= B_DIRTY;
-  iderw(b);
+  bsubmit(&b, 1);
+  bwait(&b, 1);
 }
 
 // Release a B_BUSY buffer.
-// Move to the head of the MRU list.
+// Mark it recently used, so the clock hand passes it over once.
+// The queues are not touched, so releasing takes only the
+// bucket lock.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bk;
+
   if((b->flags & B_BUSY) == 0)
     panic("brelse");
 
-  acquire(&bcache.lock);
-
-  b->next->prev = b->prev;
-  b->prev->next = b->next;
-  b->next = bcache.head.next;
-  b->prev = &bcache.head;
-  bcache.head.next->prev = b;
-  bcache.head.next = b;
-
+  bk = bucket(b->dev, b->blockno);
+  acquire(&bk->lock);
+  b->flags |= B_REF;
   b->flags &= ~B_BUSY;
   wakeup(b);
+  release(&bk->lock);
+}
 
+// Report cache statistics.
+void
+bstat(struct bcstat *st)
+{
+  int i;
+
+  acquire(&bcache.lock);
+  st->nbuf = bcache.nbuf;
+  st->nin = bcache.in.n;
+  st->nmain = bcache.main.n;
+  st->misses = bcache.misses;
+  st->ghosthits = bcache.ghosthits;
   release(&bcache.lock);
+  st->hits = 0;
+  for(i = 0; i < NBUCKET; i++)
+    st->hits += bcache.bucket[i].hits;
 }
 //PAGEBREAK!
 // Blank page.
-
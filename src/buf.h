@@ -2,12 +2,15 @@ struct buf {
   int flags;
   uint dev;
   uint blockno;
-  struct buf *prev; // LRU cache list
+  struct queue *q;  // replacement queue
+  struct buf *prev; // ring in q
   struct buf *next;
+  struct buf *hnext; // hash chain
   struct buf *qnext; // disk queue
-  uchar data[BSIZE];
+  uchar *data;       // BSIZE bytes
 };
 #define B_BUSY  0x1  // buffer is locked by some process
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
-
+#define B_REF   0x8  // buffer was used since the clock hand last passed
+#define B_ASYNC 0x10 // disk driver releases buffer when I/O is done
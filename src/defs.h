@@ -1,7 +1,9 @@
+struct bcstat;
 struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
 struct rtcdate;
@@ -11,8 +13,16 @@ struct superblock;
 
 // bio.c
 void            binit(void);
+void            biodone(struct buf*);
+void            bfill(struct buf**, int);
+void            bgetn(uint, uint*, struct buf**, int);
 struct buf*     bread(uint, uint);
+void            breadahead(uint, uint);
 void            brelse(struct buf*);
+void            breserve(int);
+void            bstat(struct bcstat*);
+void            bsubmit(struct buf**, int);
+void            bwait(struct buf**, int);
 void            bwrite(struct buf*);
 
 // console.c
@@ -37,6 +47,7 @@ int             filewrite(struct file*, char*, int n);
 void            readsb(int dev, struct superblock *sb);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
+void            dirunlink(struct inode*, char*, uint);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit(int dev);
@@ -49,13 +60,14 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, char*, uint, uint);
+void            ireadahead(struct inode*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, char*, uint, uint);
 
 // ide.c
 void            ideinit(void);
 void            ideintr(void);
-void            iderw(struct buf*);
+void            idesubmit(struct buf**, int);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -64,9 +76,12 @@ void            ioapicinit(void);
 
 // kalloc.c
 char*           kalloc(void);
+char*           kalloc_zeroed(void);
 void            kfree(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+extern uint     phystop;
+void            kzeroidle(void);
 
 // kbd.c
 void            kbdintr(void);
@@ -83,8 +98,18 @@ void            microdelay(int);
 // log.c
 void            initlog(int dev);
 void            log_write(struct buf*);
+int             log_maxop(void);
 void            begin_op();
+void            begin_opn(int);
 void            end_op();
+int             log_room(void);
+void            restart_op(void);
+
+// mmap.c
+int             mmapcheck(uint, uint, int);
+void            mmapclose(struct proc*);
+int             mmapfault(uint, int);
+int             mmapfork(struct proc*);
 
 // mp.c
 extern int      ismp;
@@ -94,7 +119,14 @@ void            mpinit(void);
 void            picenable(int);
 void            picinit(void);
 
+// pci.c
+int             pcifind(uint, uint, uint*);
+int             pcifindclass(uint, uint, uint*);
+uint            pciread(uint, int);
+void            pciwrite(uint, int, uint);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, char*, int);
@@ -119,6 +151,12 @@ void            yield(void);
 // swtch.S
 void            swtch(struct context**, struct context*);
 
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 void            getcallerpcs(void*, uint*);
@@ -140,6 +178,7 @@ char*           strncpy(char*, const char*, int);
 // syscall.c
 int             argint(int, int*);
 int             argptr(int, char**, int);
+int             argrptr(int, char**, int);
 int             argstr(int, char**);
 int             fetchint(uint, int*);
 int             fetchstr(uint, char**);
@@ -159,6 +198,12 @@ void            uartinit(void);
 void            uartintr(void);
 void            uartputc(int);
 
+// virtio.c
+int             virtioinit(void);
+void            virtiointr(void);
+extern int      virtioirq;
+void            virtiosubmit(struct buf**, int);
+
 // vm.c
 void            seginit(void);
 void            kvmalloc(void);
@@ -169,7 +214,9 @@ int             deallocuvm(pde_t*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
+int             mappages(pde_t*, void*, uint, uint, int);
 pde_t*          copyuvm(pde_t*, uint);
+int             copypages(pde_t*, pde_t*, uint, uint);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
@@ -98,6 +98,7 @@ exec(char *path, char **argv)
   proc->tf->esp = sp;
   switchuvm(proc);
   freevm(oldpgdir);
+  mmapclose(proc);
   return 0;
 
  bad:
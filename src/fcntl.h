@@ -2,3 +2,7 @@
 #define O_WRONLY  0x001
 #define O_RDWR    0x002
 #define O_CREATE  0x200
+
+#define PROT_READ   0x001  // mmap protection
+#define PROT_WRITE  0x002
+#define MAP_PRIVATE 0x002  // mmap flags
@@ -12,13 +12,16 @@
 struct devsw devsw[NDEV];
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kmem_cache *cache;
+  int nfile;  // number of allocated files
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  if((ftable.cache = kmem_cache_create("file", sizeof(struct file))) == 0)
+    panic("fileinit");
 }
 
 // Allocate a file structure.
@@ -28,15 +31,22 @@ filealloc(void)
   struct file *f;
 
   acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
+  if(ftable.nfile >= NFILE){
+    release(&ftable.lock);
+    return 0;
   }
+  ftable.nfile++;
   release(&ftable.lock);
-  return 0;
+
+  if((f = kmem_cache_alloc(ftable.cache)) == 0){
+    acquire(&ftable.lock);
+    ftable.nfile--;
+    release(&ftable.lock);
+    return 0;
+  }
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -67,7 +77,9 @@ fileclose(struct file *f)
   ff = *f;
   f->ref = 0;
   f->type = FD_NONE;
+  ftable.nfile--;
   release(&ftable.lock);
+  kmem_cache_free(ftable.cache, f);
 
   if(ff.type == FD_PIPE)
     pipeclose(ff.pipe, ff.writable);
@@ -102,9 +114,29 @@ fileread(struct file *f, char *addr, int n)
   if(f->type == FD_PIPE)
     return piperead(f->pipe, addr, n);
   if(f->type == FD_INODE){
+    // A read that starts where the last one ended is
+    // sequential: grow the read-ahead window.
+    // Anything else shuts read-ahead off.
+    if(f->off == f->rdend){
+      if(f->rawin == 0)
+        f->rawin = 4;
+      else if(f->rawin < RAMAX)
+        f->rawin *= 2;
+    } else {
+      f->rawin = 0;
+      f->raend = 0;
+    }
     ilock(f->ip);
     if((r = readi(f->ip, addr, f->off, n)) > 0)
       f->off += r;
+    f->rdend = f->off;
+    // Keep the next rawin blocks on their way from the disk.
+    if(r > 0 && f->rawin > 0){
+      if(f->raend < f->off)
+        f->raend = f->off;
+      ireadahead(f->ip, f->raend, f->off + f->rawin*BSIZE - f->raend);
+      f->raend = f->off + f->rawin*BSIZE;
+    }
     iunlock(f->ip);
     return r;
   }
@@ -112,6 +144,18 @@ fileread(struct file *f, char *addr, int n)
 }
 
 //PAGEBREAK!
+// Log blocks a write of nb data blocks may dirty: each block
+// and its allocation block, the i-node, the last extent block,
+// and 2 blocks of slop for non-aligned writes.  The new extents
+// may also fill nb/NINDEXT+1 new extent blocks, plus a new
+// dindirect or tindirect chain of up to 2 blocks above them;
+// each costs itself, its allocation block and its parent.
+static int
+writeop(int nb)
+{
+  return 2*nb + 1 + 1 + 2 + 3*(nb/NINDEXT + 1 + 2);
+}
+
 // Write to file f.
 int
 filewrite(struct file *f, char *addr, int n)
@@ -124,19 +168,21 @@ filewrite(struct file *f, char *addr, int n)
     return pipewrite(f->pipe, addr, n);
   if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // the maximum log transaction size, and reserve only
+    // the log space each write needs (see writeop).
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((LOGSIZE-1-1-2) / 2) * 512;
+    int max = 0;
+    while(writeop(max+1) <= log_maxop())
+      max++;
+    max *= BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
-      begin_op();
+      begin_opn(writeop((n1 + BSIZE-1) / BSIZE));
       ilock(f->ip);
       if ((r = writei(f->ip, addr + i, f->off, n1)) > 0)
         f->off += r;
@@ -145,9 +191,9 @@ filewrite(struct file *f, char *addr, int n)
 
       if(r < 0)
         break;
-      if(r != n1)
-        panic("short filewrite");
       i += r;
+      if(r != n1)
+        break;  // file is out of extents
     }
     return i == n ? n : -1;
   }
@@ -6,6 +6,9 @@ struct file {
   struct pipe *pipe;
   struct inode *ip;
   uint off;
+  uint rdend;  // where the last read ended, to detect sequential reads
+  uint raend;  // read-ahead has been started up to here
+  uint rawin;  // read-ahead window, in blocks
 };
 
 
@@ -15,13 +18,23 @@ struct inode {
   uint inum;          // Inode number
   int ref;            // Reference count
   int flags;          // I_BUSY, I_VALID
+  struct inode *next; // icache hash chain
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  struct extent ext[NEXTENT];
+  uint indirect;
+  uint dindirect;
+  uint tindirect;
+
+  uint cnum;          // bmap cache: number of the extent last used,
+  uint cbase;         //   the file block it starts at,
+  struct extent cext; //   and a copy of it (cext.len is 0 if none)
+  uint cleaf;         // extent block last used, plus 1 (0 if none),
+  uint cleafaddr;     //   and its disk address
 };
 #define I_BUSY 0x1
 #define I_VALID 0x2
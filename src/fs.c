@@ -15,6 +15,7 @@
 #include "stat.h"
 #include "mmu.h"
 #include "proc.h"
+#include "x86.h"
 #include "spinlock.h"
 #include "fs.h"
 #include "buf.h"
@@ -22,6 +23,9 @@
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
+static void imapinit(uint);
+static void dcinit(void);
+static void dcpurge(uint, uint);
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
@@ -50,48 +54,152 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// The free map has one bit per block.  Each free map block
+// covers a group of BPB blocks.  The kernel counts the free
+// blocks in each group when the file system is mounted and
+// keeps the counts up to date, so balloc() skips full groups
+// without reading their free map blocks.  Allocations with
+// no goal continue from where the last one left off.
+
+struct {
+  struct spinlock lock;
+  ushort *nfree;  // free blocks in each group
+  uint ngroup;
+  uint free;      // free blocks on the disk
+  uint cursor;    // where to look when there is no goal
+} freemap;
+
+// Return the first clear bit in the bitmap at data
+// at or after bit start and before bit end, or -1.
+// Scans a word at a time.
+static int
+bmfind(uchar *data, uint start, uint end)
+{
+  uint *w, i, x, b;
+
+  w = (uint*)data;
+  for(i = start/32; i*32 < end; i++){
+    x = ~w[i];
+    if(i == start/32)
+      x &= ~0U << (start%32);
+    if(x){
+      b = i*32 + bsf(x);
+      return b < end ? b : -1;
+    }
+  }
+  return -1;
+}
 
-// Allocate a zeroed disk block.
+// Number of blocks covered by free map block g.
 static uint
-balloc(uint dev)
+groupsize(uint g)
+{
+  return min(BPB, sb.size - g*BPB);
+}
+
+// Count the free blocks in each group.
+static void
+freemapinit(uint dev)
 {
-  int b, bi, m;
   struct buf *bp;
+  uint g, n;
+  int bi;
+
+  initlock(&freemap.lock, "freemap");
+  freemap.ngroup = (sb.size + BPB-1) / BPB;
+  if(freemap.ngroup > MAXBGROUP ||
+     (freemap.nfree = (ushort*)kalloc()) == 0)
+    panic("freemapinit");
+  for(g = 0; g < freemap.ngroup; g++){
+    bp = bread(dev, BBLOCK(g*BPB, sb));
+    n = 0;
+    for(bi = 0; (bi = bmfind(bp->data, bi, groupsize(g))) >= 0; bi++)
+      n++;
+    brelse(bp);
+    freemap.nfree[g] = n;
+    freemap.free += n;
+  }
+}
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
+// Allocate a zeroed disk block, preferring goal or the
+// first free block after it.
+static uint
+balloc(uint dev, uint goal)
+{
+  uint b, g, n, start;
+  int bi;
+  struct buf *bp;
+
+  if(freemap.free == 0)
+    panic("balloc: out of blocks");
+  if(goal == 0 || goal >= sb.size)
+    goal = freemap.cursor;
+  g = goal / BPB;
+  start = goal % BPB;
+  for(n = 0; n <= freemap.ngroup; n++){
+    if(freemap.nfree[g]){
+      bp = bread(dev, BBLOCK(g*BPB, sb));
+      if((bi = bmfind(bp->data, start, groupsize(g))) >= 0){
+        bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+        b = g*BPB + bi;
+        acquire(&freemap.lock);
+        freemap.nfree[g]--;
+        freemap.free--;
+        freemap.cursor = b + 1;
+        release(&freemap.lock);
+        bzero(dev, b);
+        return b;
       }
+      brelse(bp);
     }
-    brelse(bp);
+    g = (g + 1) % freemap.ngroup;
+    start = 0;
   }
   panic("balloc: out of blocks");
 }
 
-// Free a disk block.
+// Free the len blocks starting at b, with one bitmap
+// update and one count update per bitmap block.
 static void
-bfree(int dev, uint b)
+bfreerange(int dev, uint b, uint len)
 {
   struct buf *bp;
-  int bi, m;
+  uint bi, end, n;
 
-  readsb(dev, &sb);
-  bp = bread(dev, BBLOCK(b, sb));
-  bi = b % BPB;
-  m = 1 << (bi % 8);
-  if((bp->data[bi/8] & m) == 0)
-    panic("freeing free block");
-  bp->data[bi/8] &= ~m;
-  log_write(bp);
-  brelse(bp);
+  for(; len > 0; b += n, len -= n){
+    n = min(len, BPB - b%BPB);
+    bp = bread(dev, BBLOCK(b, sb));
+    for(bi = b%BPB, end = bi + n; bi < end; ){
+      if(bi%8 == 0 && end - bi >= 8){
+        // A whole byte at a time.
+        if(bp->data[bi/8] != 0xFF)
+          panic("freeing free block");
+        bp->data[bi/8] = 0;
+        bi += 8;
+      } else {
+        if((bp->data[bi/8] & (1 << (bi%8))) == 0)
+          panic("freeing free block");
+        bp->data[bi/8] &= ~(1 << (bi%8));
+        bi++;
+      }
+    }
+    log_write(bp);
+    brelse(bp);
+    acquire(&freemap.lock);
+    freemap.nfree[b/BPB] += n;
+    freemap.free += n;
+    release(&freemap.lock);
+  }
+}
+
+// Free a disk block.
+static void
+bfree(int dev, uint b)
+{
+  bfreerange(dev, b, 1);
 }
 
 // Inodes.
@@ -110,6 +218,10 @@ bfree(int dev, uint b)
 // to inodes used by multiple processes. The cached
 // inodes include book-keeping information that is
 // not stored on disk: ip->ref and ip->flags.
+// Cache entries come from a slab cache, so the cache
+// only uses memory for inodes that are actually in use
+// (at most NINODE of them), and are found by hashing
+// (dev, inum) into one of NIHASH chains.
 //
 // An inode and its in-memory represtative go through a
 // sequence of states before they can be used by the
@@ -119,12 +231,12 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, iput() frees if
 //   the link count has fallen to zero.
 //
-// * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() to find or
-//   create a cache entry and increment its ref, iput()
-//   to decrement ref.
+// * Referencing in cache: ip->ref tracks the number of
+//   in-memory pointers to the entry (open files and
+//   current directories). iget() to find or create a
+//   cache entry and increment its ref, iput() to
+//   decrement ref. iput() frees the entry when ref
+//   falls to zero.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   cache entry is only correct when the I_VALID bit
@@ -156,24 +268,85 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 
+#define NIHASH 1021  // hash chains (prime)
+#define IHASH(dev, inum) (((dev)*31 + (inum)) % NIHASH)
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kmem_cache *cache;
+  struct inode *hash[NIHASH];  // cached inodes
+  int ninode;                  // how many
 } icache;
 
 void
 iinit(int dev)
 {
   initlock(&icache.lock, "icache");
+  dcinit();
+  if((icache.cache = kmem_cache_create("inode", sizeof(struct inode))) == 0)
+    panic("iinit");
   readsb(dev, &sb);
-  cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
-          inodestart %d bmap start %d\n", sb.size, sb.nblocks,
+  if(sb.version != FSVERSION)
+    panic("iinit: unknown file system version");
+  if(sb.bsize != BSIZE)
+    panic("iinit: file system block size is not BSIZE");
+  initlog(dev);  // recover before reading the free maps
+  freemapinit(dev);
+  imapinit(dev);
+  cprintf("sb: size %d bsize %d nblocks %d ninodes %d nlog %d logstart %d\
+          inodestart %d bmap start %d\n", sb.size, sb.bsize, sb.nblocks,
           sb.ninodes, sb.nlog, sb.logstart, sb.inodestart,
           sb.bmapstart);
 }
 
 static struct inode* iget(uint dev, uint inum);
 
+// Inode allocation map: one bit per inode, set if the
+// inode is in use (its type on disk is non-zero).  Built
+// at mount time, so that ialloc() need not search the
+// inode blocks.
+struct {
+  struct spinlock lock;
+  uint bits[MAXINODE/32];
+  uint next;  // no inode below this one is free
+} imap;
+
+static void
+imapinit(uint dev)
+{
+  struct buf *bp;
+  struct dinode *dip;
+  uint inum;
+
+  initlock(&imap.lock, "imap");
+  if(sb.ninodes > MAXINODE)
+    panic("imapinit: too many inodes");
+  bp = 0;
+  for(inum = 0; inum < sb.ninodes; inum++){
+    if(bp == 0 || inum % IPB == 0){
+      if(bp)
+        brelse(bp);
+      bp = bread(dev, IBLOCK(inum, sb));
+    }
+    dip = (struct dinode*)bp->data + inum%IPB;
+    if(inum == 0 || dip->type != 0)
+      imap.bits[inum/32] |= 1 << (inum%32);
+  }
+  brelse(bp);
+  imap.next = 1;
+}
+
+// Mark inode inum free.
+static void
+imapfree(uint inum)
+{
+  acquire(&imap.lock);
+  imap.bits[inum/32] &= ~(1 << (inum%32));
+  if(inum < imap.next)
+    imap.next = inum;
+  release(&imap.lock);
+}
+
 //PAGEBREAK!
 // Allocate a new inode with the given type on device dev.
 // A free inode has a type of zero.
@@ -184,19 +357,22 @@ ialloc(uint dev, short type)
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
-      memset(dip, 0, sizeof(*dip));
-      dip->type = type;
-      log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
-    }
-    brelse(bp);
-  }
-  panic("ialloc: no inodes");
+  acquire(&imap.lock);
+  if((inum = bmfind((uchar*)imap.bits, imap.next, sb.ninodes)) < 0)
+    panic("ialloc: no inodes");
+  imap.bits[inum/32] |= 1 << (inum%32);
+  imap.next = inum + 1;
+  release(&imap.lock);
+
+  bp = bread(dev, IBLOCK(inum, sb));
+  dip = (struct dinode*)bp->data + inum%IPB;
+  if(dip->type != 0)
+    panic("ialloc: inode in use");
+  memset(dip, 0, sizeof(*dip));
+  dip->type = type;
+  log_write(bp);   // mark it allocated on the disk
+  brelse(bp);
+  return iget(dev, inum);
 }
 
 // Copy a modified in-memory inode to disk.
@@ -213,7 +389,10 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  memmove(dip->ext, ip->ext, sizeof(ip->ext));
+  dip->indirect = ip->indirect;
+  dip->dindirect = ip->dindirect;
+  dip->tindirect = ip->tindirect;
   log_write(bp);
   brelse(bp);
 }
@@ -224,31 +403,31 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
 
   acquire(&icache.lock);
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  for(ip = icache.hash[IHASH(dev, inum)]; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
       ip->ref++;
       release(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
+  // Allocate an inode cache entry.
+  if(icache.ninode >= NINODE || (ip = kmem_cache_alloc(icache.cache)) == 0)
     panic("iget: no inodes");
 
-  ip = empty;
+  memset(ip, 0, sizeof(*ip));
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->flags = 0;
+  ip->next = icache.hash[IHASH(dev, inum)];
+  icache.hash[IHASH(dev, inum)] = ip;
+  icache.ninode++;
   release(&icache.lock);
 
   return ip;
@@ -290,7 +469,12 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    memmove(ip->ext, dip->ext, sizeof(ip->ext));
+    ip->indirect = dip->indirect;
+    ip->dindirect = dip->dindirect;
+    ip->tindirect = dip->tindirect;
+    ip->cext.len = 0;
+    ip->cleaf = 0;
     brelse(bp);
     ip->flags |= I_VALID;
     if(ip->type == 0)
@@ -312,8 +496,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode cache entry can
-// be recycled.
+// If that was the last reference, the inode cache entry is
+// freed.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -321,6 +505,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
+  struct inode **pp;
+  short type;
+
   acquire(&icache.lock);
   if(ip->ref == 1 && (ip->flags & I_VALID) && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -329,14 +516,29 @@ iput(struct inode *ip)
     ip->flags |= I_BUSY;
     release(&icache.lock);
     itrunc(ip);
+    type = ip->type;
     ip->type = 0;
     iupdate(ip);
+    // Forget a directory's names before its inum can be reused.
+    if(type == T_DIR)
+      dcpurge(ip->dev, ip->inum);
+    imapfree(ip->inum);
     acquire(&icache.lock);
     ip->flags = 0;
     wakeup(ip);
   }
-  ip->ref--;
+  if(--ip->ref > 0){
+    release(&icache.lock);
+    return;
+  }
+  pp = &icache.hash[IHASH(ip->dev, ip->inum)];
+  for(; *pp != ip; pp = &(*pp)->next)
+    if(*pp == 0)
+      panic("iput: not cached");
+  *pp = ip->next;
+  icache.ninode--;
   release(&icache.lock);
+  kmem_cache_free(icache.cache, ip);
 }
 
 // Common idiom: unlock, then put.
@@ -351,40 +553,211 @@ iunlockput(struct inode *ip)
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// in extents: runs of consecutive disk blocks, each given
+// by its first block and its length.  Extents are numbered
+// in file order and cover the file with no holes; unused
+// extents have length 0.  The first NEXTENT are in ip->ext[].
+// The rest are in extent blocks of NINDEXT each: first block
+// ip->indirect, then the NINDIRECT blocks listed in block
+// ip->dindirect, then the NINDIRECT*NINDIRECT blocks found
+// through two levels of blocks under ip->tindirect.
+//
+// A new block goes right after the file's last block when
+// that one is free, so a file written sequentially usually
+// occupies a few long extents.
+//
+// Each cached inode remembers the extent bmap last used and
+// the extent block last read, so that sequential access
+// neither rescans the extents nor rereads the blocks that
+// lead to them.
+
+// Return the address of extent block n of ip, counting
+// ip->indirect as 0.  If there is no such block, allocate
+// one if alloc is set, and otherwise return 0.
+static uint
+extblock(struct inode *ip, uint n, int alloc)
+{
+  struct buf *bp;
+  uint *root, *a, addr, leaf;
+  int level;
+
+  if(ip->cleaf == n+1)
+    return ip->cleafaddr;
+  leaf = n;
+  if(n == 0){
+    root = &ip->indirect;
+    level = 0;
+  } else if((n -= 1) < NINDIRECT){
+    root = &ip->dindirect;
+    level = 1;
+  } else if((n -= NINDIRECT) < NINDIRECT*NINDIRECT){
+    root = &ip->tindirect;
+    level = 2;
+  } else
+    return 0;
+
+  if((addr = *root) == 0){
+    if(!alloc)
+      return 0;
+    *root = addr = balloc(ip->dev, 0);
+  }
+  for(; level > 0; level--){
+    bp = bread(ip->dev, addr);
+    a = (uint*)bp->data + (level == 2 ? n / NINDIRECT : n % NINDIRECT);
+    if((addr = *a) == 0 && alloc){
+      *a = addr = balloc(ip->dev, 0);
+      log_write(bp);
+    }
+    brelse(bp);
+    if(addr == 0)
+      return 0;
+  }
+  ip->cleaf = leaf+1;
+  ip->cleafaddr = addr;
+  return addr;
+}
+
+// Return a pointer to extent k of ip.  If it is in an extent
+// block, *bpp is set to that block's buf, which the caller
+// must release; otherwise *bpp is 0.  Returns 0 if the extent
+// block does not exist and alloc is not set.
+static struct extent*
+getext(struct inode *ip, uint k, int alloc, struct buf **bpp)
+{
+  uint addr;
+
+  *bpp = 0;
+  if(k < NEXTENT)
+    return &ip->ext[k];
+  k -= NEXTENT;
+  if((addr = extblock(ip, k / NINDEXT, alloc)) == 0)
+    return 0;
+  *bpp = bread(ip->dev, addr);
+  return (struct extent*)(*bpp)->data + k % NINDEXT;
+}
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If bn is the first block past the end of the file, bmap
+// allocates one.  Returns 0 if the file is out of extents.
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
+  struct extent *e;
   struct buf *bp;
-
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
-    return addr;
+  uint k, base, goal, addr;
+
+  k = base = goal = 0;
+  if(ip->cext.len && bn >= ip->cbase){
+    if(bn < ip->cbase + ip->cext.len)
+      return ip->cext.start + bn - ip->cbase;
+    k = ip->cnum;
+    base = ip->cbase;
   }
-  bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
+  for(;; k++){
+    if((e = getext(ip, k, 0, &bp)) == 0)
+      break;
+    if(e->len == 0){
+      if(bp)
+        brelse(bp);
+      break;
+    }
+    if(bn < base + e->len){
+      ip->cnum = k;
+      ip->cbase = base;
+      ip->cext = *e;
+      if(bp)
+        brelse(bp);
+      return e->start + bn - base;
     }
+    base += e->len;
+    goal = e->start + e->len;
+    if(bp)
+      brelse(bp);
+  }
+  if(bn != base)
+    panic("bmap: out of range");
+
+  // Append a block, extending the last extent
+  // if the block after it is free.
+  addr = balloc(ip->dev, goal);
+  if(k > 0 && addr == goal){
+    e = getext(ip, --k, 0, &bp);
+    e->len++;
+    base -= e->len - 1;
+  } else if((e = getext(ip, k, 1, &bp)) != 0){
+    e->start = addr;
+    e->len = 1;
+  } else {
+    bfree(ip->dev, addr);
+    return 0;
+  }
+  ip->cnum = k;
+  ip->cbase = base;
+  ip->cext = *e;
+  if(bp){
+    log_write(bp);
     brelse(bp);
-    return addr;
   }
+  return addr;
+}
 
-  panic("bmap: out of range");
+// Free the blocks of the n extents at e, which bp holds
+// (0 if they are in the inode), shrinking each extent as
+// its blocks go.  Returns -1 if it stopped early because
+// the FS operation has no log room left.
+static int
+extfree(struct inode *ip, struct extent *e, int n, struct buf *bp)
+{
+  uint m, room;
+  int i;
+
+  for(i = 0; i < n; i++){
+    while(e[i].len > 0){
+      // A bitmap block per group touched, plus bp and the inode.
+      if((room = log_room()) < 3)
+        return -1;
+      m = min(e[i].len, BPB - e[i].start%BPB + (room-3)*BPB);
+      bfreerange(ip->dev, e[i].start, m);
+      e[i].start += m;
+      e[i].len -= m;
+      if(bp)
+        log_write(bp);
+    }
+  }
+  return 0;
+}
+
+// Free block *slot and everything under it: the extents
+// in it if level is 0, otherwise the blocks it lists,
+// each one level down.  Then clear *slot, which pb holds
+// (0 if it is in the inode).  Returns -1 if it stopped
+// early for lack of log room; what is left is still
+// reachable from *slot.
+static int
+exttrunc(struct inode *ip, uint *slot, struct buf *pb, int level)
+{
+  struct buf *bp;
+  uint *a;
+  int i, r;
+
+  bp = bread(ip->dev, *slot);
+  if(level == 0)
+    r = extfree(ip, (struct extent*)bp->data, NINDEXT, bp);
+  else {
+    a = (uint*)bp->data;
+    for(i = 0, r = 0; i < NINDIRECT && r == 0; i++)
+      if(a[i])
+        r = exttrunc(ip, &a[i], bp, level - 1);
+  }
+  brelse(bp);
+  if(r < 0 || log_room() < 3)
+    return -1;
+  bfree(ip->dev, *slot);
+  *slot = 0;
+  if(pb)
+    log_write(pb);
+  return 0;
 }
 
 // Truncate inode (discard contents).
@@ -392,32 +765,24 @@ bmap(struct inode *ip, uint bn)
 // to it (no directory entries referring to it)
 // and has no in-memory reference to it (is
 // not an open file or current directory).
+// A big file can dirty more bitmap and extent blocks
+// than one FS operation may, so free it in pieces and
+// restart the operation in between; each piece leaves
+// the inode pointing at what is left.  So the caller
+// must not hold other inode locks or any buffers.
 static void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
-
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
-    }
-  }
-
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+  ip->cext.len = 0;
+  ip->cleaf = 0;
+  while(extfree(ip, ip->ext, NEXTENT, 0) < 0 ||
+        (ip->indirect && exttrunc(ip, &ip->indirect, 0, 0) < 0) ||
+        (ip->dindirect && exttrunc(ip, &ip->dindirect, 0, 1) < 0) ||
+        (ip->tindirect && exttrunc(ip, &ip->tindirect, 0, 2) < 0)){
+    iupdate(ip);
+    restart_op();
   }
-
+  memset(ip->ext, 0, sizeof(ip->ext));
   ip->size = 0;
   iupdate(ip);
 }
@@ -438,8 +803,9 @@ stati(struct inode *ip, struct stat *st)
 int
 readi(struct inode *ip, char *dst, uint off, uint n)
 {
-  uint tot, m;
-  struct buf *bp;
+  uint tot, m, o, end, blocks[NRUN];
+  struct buf *bufs[NRUN];
+  int i, nb;
 
   if(ip->type == T_DEV){
     if(ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].read)
@@ -452,22 +818,47 @@ readi(struct inode *ip, char *dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
-  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
-    m = min(n - tot, BSIZE - off%BSIZE);
-    memmove(dst, bp->data + off%BSIZE, m);
-    brelse(bp);
+  // Map up to NRUN blocks, then pin and read them together.
+  for(tot=0; tot<n; ){
+    end = off + (n - tot);
+    for(nb = 0, o = off; nb < NRUN && o < end; nb++, o += BSIZE - o%BSIZE)
+      blocks[nb] = bmap(ip, o/BSIZE);
+    bgetn(ip->dev, blocks, bufs, nb);
+    bfill(bufs, nb);
+    for(i = 0; i < nb; i++, tot+=m, off+=m, dst+=m){
+      m = min(n - tot, BSIZE - off%BSIZE);
+      memmove(dst, bufs[i]->data + off%BSIZE, m);
+      brelse(bufs[i]);
+    }
   }
   return n;
 }
 
+// Start reading the blocks holding bytes [off, off+n) of ip
+// into the buffer cache, without waiting for them.
+// Caller must hold ip->lock.
+void
+ireadahead(struct inode *ip, uint off, uint n)
+{
+  uint end;
+
+  if(ip->type == T_DEV || off >= ip->size)
+    return;
+  end = off + n;
+  if(end > ip->size || end < off)
+    end = ip->size;
+  for(off -= off%BSIZE; off < end; off += BSIZE)
+    breadahead(ip->dev, bmap(ip, off/BSIZE));
+}
+
 // PAGEBREAK!
 // Write data to inode.
 int
 writei(struct inode *ip, char *src, uint off, uint n)
 {
-  uint tot, m;
-  struct buf *bp;
+  uint tot, m, o, end, blocks[NRUN];
+  struct buf *bufs[NRUN], *rd[2];
+  int i, nb, nr;
 
   if(ip->type == T_DEV){
     if(ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].write)
@@ -480,19 +871,37 @@ writei(struct inode *ip, char *src, uint off, uint n)
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
-  for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
-    m = min(n - tot, BSIZE - off%BSIZE);
-    memmove(bp->data + off%BSIZE, src, m);
-    log_write(bp);
-    brelse(bp);
+  for(tot=0; tot<n; ){
+    end = off + (n - tot);
+    for(nb = 0, o = off; nb < NRUN && o < end; nb++, o += BSIZE - o%BSIZE)
+      if((blocks[nb] = bmap(ip, o/BSIZE)) == 0)
+        break;  // out of extents
+    if(nb == 0)
+      break;
+    bgetn(ip->dev, blocks, bufs, nb);
+
+    // Only blocks that are partly overwritten need reading.
+    for(nr = 0, i = 0, o = off; i < nb; i++, o += BSIZE - o%BSIZE)
+      if(o%BSIZE != 0 || end - o < BSIZE)
+        rd[nr++] = bufs[i];
+    bfill(rd, nr);
+
+    for(i = 0; i < nb; i++, tot+=m, off+=m, src+=m){
+      m = min(n - tot, BSIZE - off%BSIZE);
+      memmove(bufs[i]->data + off%BSIZE, src, m);
+      bufs[i]->flags |= B_VALID;
+      log_write(bufs[i]);
+      brelse(bufs[i]);
+    }
+    if(nb < NRUN && tot < n)
+      break;  // out of extents
   }
 
-  if(n > 0 && off > ip->size){
+  if(tot > 0 && off > ip->size){
     ip->size = off;
     iupdate(ip);
   }
-  return n;
+  return tot;
 }
 
 //PAGEBREAK!
@@ -504,6 +913,450 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Hashed directories.
+//
+// dxlookup() and dxlink() follow the index from block 0
+// down to the one leaf that can hold a name.  When that
+// leaf is full, dxsplit() moves its upper half, by hash,
+// to a new leaf at the end of the directory.  When an
+// index block is full, the root gains a level, or a
+// deeper index block is split in two.  Leaves are never
+// merged; unlink just clears the entry.
+
+#define DEPB    (BSIZE / sizeof(struct dirent))  // dirents per block
+#define DXROOT  2  // slot of the dxhead in block 0
+#define DXENT(h) ((struct dxentry*)((h) + 1))
+
+// Where dxwalk() went to find a leaf.
+struct dxpath {
+  int depth;     // index blocks below the root
+  uint blk[2];   // index blocks visited, blk[0] is the root
+  int idx[2];    // entry followed in each
+  uint leaf;
+};
+
+static struct buf*
+dirblock(struct inode *dp, uint bn)
+{
+  return bread(dp->dev, bmap(dp, bn));
+}
+
+static uint
+dxhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261U;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+// The index node in bp, and how many entries it holds.
+static struct dxhead*
+dxnode(struct buf *bp, int root, int *max)
+{
+  if(root){
+    *max = DEPB - DXROOT - 1;
+    return (struct dxhead*)bp->data + DXROOT;
+  }
+  *max = DEPB - 1;
+  return (struct dxhead*)bp->data;
+}
+
+// Is directory dp indexed?
+static int
+dxindexed(struct inode *dp)
+{
+  struct buf *bp;
+  struct dxhead *h;
+  int max, r;
+
+  if(dp->size <= BSIZE)
+    return 0;
+  bp = dirblock(dp, 0);
+  // The header overlays a dirent whose inum is always 0, so a
+  // name that happens to spell DXMAGIC can't pass for one.
+  h = dxnode(bp, 1, &max);
+  r = h->zero == 0 && h->magic == DXMAGIC;
+  brelse(bp);
+  return r;
+}
+
+// Index of the last entry in node h with a hash <= hash.
+static int
+dxfind(struct dxhead *h, uint hash)
+{
+  struct dxentry *e;
+  int i;
+
+  e = DXENT(h);
+  for(i = 1; i < h->count && e[i].hash <= hash; i++)
+    ;
+  return i - 1;
+}
+
+// Insert entry (hash, block) into node h after entry i.
+static void
+dxinsert(struct dxhead *h, int i, uint hash, uint block)
+{
+  struct dxentry *e;
+
+  e = DXENT(h);
+  memmove(&e[i+2], &e[i+1], (h->count - i - 1) * sizeof(*e));
+  memset(&e[i+1], 0, sizeof(*e));
+  e[i+1].hash = hash;
+  e[i+1].block = block;
+  h->count++;
+}
+
+// Find the leaf of dp that holds names with this hash.
+static void
+dxwalk(struct inode *dp, uint hash, struct dxpath *p)
+{
+  struct buf *bp;
+  struct dxhead *h;
+  uint blk;
+  int level, max;
+
+  blk = 0;
+  for(level = 0; ; level++){
+    bp = dirblock(dp, blk);
+    h = dxnode(bp, level == 0, &max);
+    if(level == 0 && (p->depth = h->depth) > 1)
+      panic("dxwalk: depth");
+    p->blk[level] = blk;
+    p->idx[level] = dxfind(h, hash);
+    blk = DXENT(h)[p->idx[level]].block;
+    brelse(bp);
+    if(level == p->depth)
+      break;
+  }
+  p->leaf = blk;
+}
+
+// Append a zeroed block to directory dp.
+// Returns its block number, or -1.
+static int
+dirgrow(struct inode *dp)
+{
+  uint bn;
+
+  bn = dp->size / BSIZE;
+  if(bmap(dp, bn) == 0)
+    return -1;
+  dp->size += BSIZE;
+  iupdate(dp);
+  return bn;
+}
+
+// Look for name in slots [from, to) of block bn of dp.
+static uint
+dirscan(struct inode *dp, uint bn, int from, int to, char *name, uint *poff)
+{
+  struct buf *bp;
+  struct dirent *de;
+  uint inum;
+  int i;
+
+  bp = dirblock(dp, bn);
+  de = (struct dirent*)bp->data;
+  inum = 0;
+  for(i = from; i < to; i++){
+    if(de[i].inum != 0 && namecmp(name, de[i].name) == 0){
+      if(poff)
+        *poff = bn*BSIZE + i*sizeof(*de);
+      inum = de[i].inum;
+      break;
+    }
+  }
+  brelse(bp);
+  return inum;
+}
+
+// Look up name in indexed directory dp.  "." and ".."
+// are in block 0, outside the index.
+static uint
+dxlookup(struct inode *dp, char *name, uint *poff)
+{
+  struct dxpath p;
+  uint inum;
+
+  if((inum = dirscan(dp, 0, 0, DXROOT, name, poff)) != 0)
+    return inum;
+  dxwalk(dp, dxhash(name), &p);
+  return dirscan(dp, p.leaf, 0, DEPB, name, poff);
+}
+
+// Make room in the index for the full leaf at the end of p:
+// split the leaf or, if its parent is full, deepen the root
+// or split the parent.  The caller walks the index again.
+// Returns -1 if the directory can hold no more.
+static int
+dxsplit(struct inode *dp, struct dxpath *p)
+{
+  struct buf *bp, *pp, *np;
+  struct dxhead *h, *nh;
+  struct dirent *de, *nde;
+  uint hash[DEPB], m, t;
+  int i, j, max, nb, root;
+
+  bp = 0;
+  pp = dirblock(dp, p->blk[p->depth]);
+  h = dxnode(pp, p->depth == 0, &max);
+  if(h->count < max){
+    // Split the leaf at the median hash, keeping
+    // equal hashes together.
+    bp = dirblock(dp, p->leaf);
+    de = (struct dirent*)bp->data;
+    for(i = 0; i < DEPB; i++){
+      t = dxhash(de[i].name);
+      for(j = i; j > 0 && hash[j-1] > t; j--)
+        hash[j] = hash[j-1];
+      hash[j] = t;
+    }
+    m = hash[DEPB/2];
+    for(i = 0; i < DEPB && hash[i] <= hash[0]; i++)
+      ;
+    if(m == hash[0] && i < DEPB)
+      m = hash[i];
+    if(m == hash[0] || (nb = dirgrow(dp)) < 0){
+      brelse(bp);
+      brelse(pp);
+      return -1;
+    }
+    np = dirblock(dp, nb);
+    nde = (struct dirent*)np->data;
+    for(i = j = 0; i < DEPB; i++){
+      if(dxhash(de[i].name) >= m){
+        nde[j++] = de[i];
+        memset(&de[i], 0, sizeof(de[i]));
+      }
+    }
+    dxinsert(h, p->idx[p->depth], m, nb);
+    log_write(np);
+    log_write(bp);
+    log_write(pp);
+    brelse(np);
+    brelse(bp);
+    brelse(pp);
+    return 0;
+  }
+
+  // The leaf's parent is full.  Move its entries to a new
+  // index block: all of them if it is the root, which then
+  // points to the new block alone, or else the upper half.
+  root = p->depth == 0;
+  if(!root){
+    bp = dirblock(dp, 0);
+    if(dxnode(bp, 1, &max)->count >= max){
+      brelse(bp);
+      brelse(pp);
+      return -1;
+    }
+  }
+  if((nb = dirgrow(dp)) < 0){
+    if(!root)
+      brelse(bp);
+    brelse(pp);
+    return -1;
+  }
+  np = dirblock(dp, nb);
+  nh = dxnode(np, 0, &max);
+  i = root ? 0 : h->count / 2;
+  nh->magic = DXMAGIC;
+  nh->count = h->count - i;
+  memmove(DXENT(nh), DXENT(h) + i, nh->count * sizeof(struct dxentry));
+  memset(DXENT(h) + i, 0, nh->count * sizeof(struct dxentry));
+  h->count = i;
+  if(root){
+    h->depth = 1;
+    dxinsert(h, -1, 0, nb);
+  } else {
+    dxinsert(dxnode(bp, 1, &max), p->idx[0], DXENT(nh)[0].hash, nb);
+    log_write(bp);
+    brelse(bp);
+  }
+  log_write(np);
+  log_write(pp);
+  brelse(np);
+  brelse(pp);
+  return 0;
+}
+
+static int
+dxlink(struct inode *dp, char *name, uint inum)
+{
+  struct dxpath p;
+  struct buf *bp;
+  struct dirent *de;
+  int i;
+
+  for(;;){
+    dxwalk(dp, dxhash(name), &p);
+    bp = dirblock(dp, p.leaf);
+    de = (struct dirent*)bp->data;
+    for(i = 0; i < DEPB; i++){
+      if(de[i].inum == 0){
+        strncpy(de[i].name, name, DIRSIZ);
+        de[i].inum = inum;
+        log_write(bp);
+        brelse(bp);
+        return 0;
+      }
+    }
+    brelse(bp);
+    if(dxsplit(dp, &p) < 0)
+      return -1;
+  }
+}
+
+// Turn dp, a linear directory with one full block, into an
+// indexed one whose single leaf holds all but "." and "..".
+// Returns -1 if it cannot.
+static int
+dxconvert(struct inode *dp)
+{
+  struct buf *bp, *lp;
+  struct dirent *de;
+  struct dxhead *h;
+  int leaf, max;
+
+  bp = dirblock(dp, 0);
+  de = (struct dirent*)bp->data;
+  if(namecmp(de[0].name, ".") != 0 || namecmp(de[1].name, "..") != 0){
+    brelse(bp);
+    return -1;
+  }
+  if((leaf = dirgrow(dp)) < 0){
+    brelse(bp);
+    return -1;
+  }
+  lp = dirblock(dp, leaf);
+  memmove(lp->data + 2*sizeof(*de), de + 2, BSIZE - 2*sizeof(*de));
+  memset(de + 2, 0, BSIZE - 2*sizeof(*de));
+  h = dxnode(bp, 1, &max);
+  h->magic = DXMAGIC;
+  dxinsert(h, -1, 0, leaf);
+  log_write(lp);
+  log_write(bp);
+  brelse(lp);
+  brelse(bp);
+  return 0;
+}
+
+// Name cache.
+//
+// Remembers recent lookups as (directory, name) -> inum,
+// with inum 0 if the name is not in the directory, so that
+// resolving the same paths again skips the directory
+// search.  A directory is locked while its entries are
+// looked up or changed, and dirlink() and dirunlink() keep
+// the cache in step.  Entries for a directory are dropped
+// when its inode is freed, since the inum may be reused.
+
+#define NDHASH 251  // hash chains (prime)
+
+struct dentry {
+  uint dev;
+  uint dir;             // directory's inum, 0 if unused
+  char name[DIRSIZ];
+  uint inum;            // 0 if name is not there
+  struct dentry *next;  // hash chain
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry ent[NDENTRY];
+  struct dentry *hash[NDHASH];
+  int hand;             // next entry to replace
+} dcache;
+
+static void
+dcinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+static struct dentry**
+dchain(uint dev, uint dir, char *name)
+{
+  return &dcache.hash[(dxhash(name) + dir*31 + dev) % NDHASH];
+}
+
+// Remove e from its hash chain.  Caller holds dcache.lock.
+static void
+dcunlink(struct dentry *e)
+{
+  struct dentry **pp;
+
+  for(pp = dchain(e->dev, e->dir, e->name); *pp != e; pp = &(*pp)->next)
+    ;
+  *pp = e->next;
+  e->dir = 0;
+}
+
+// Look up name in dp in the cache.  Returns 1 and sets
+// *inum if the lookup is cached.
+static int
+dcget(struct inode *dp, char *name, uint *inum)
+{
+  struct dentry *e;
+
+  acquire(&dcache.lock);
+  for(e = *dchain(dp->dev, dp->inum, name); e; e = e->next){
+    if(e->dir == dp->inum && e->dev == dp->dev &&
+       namecmp(e->name, name) == 0){
+      *inum = e->inum;
+      release(&dcache.lock);
+      return 1;
+    }
+  }
+  release(&dcache.lock);
+  return 0;
+}
+
+// Record that name in dp refers to inum (0 for none).
+static void
+dcput(struct inode *dp, char *name, uint inum)
+{
+  struct dentry *e, **pp;
+
+  acquire(&dcache.lock);
+  pp = dchain(dp->dev, dp->inum, name);
+  for(e = *pp; e; e = e->next)
+    if(e->dir == dp->inum && e->dev == dp->dev &&
+       namecmp(e->name, name) == 0)
+      break;
+  if(e == 0){
+    e = &dcache.ent[dcache.hand];
+    dcache.hand = (dcache.hand + 1) % NDENTRY;
+    if(e->dir)
+      dcunlink(e);
+    e->dev = dp->dev;
+    e->dir = dp->inum;
+    strncpy(e->name, name, DIRSIZ);
+    e->next = *pp;
+    *pp = e;
+  }
+  e->inum = inum;
+  release(&dcache.lock);
+}
+
+// Forget every entry for directory inum.
+static void
+dcpurge(uint dev, uint inum)
+{
+  struct dentry *e;
+
+  acquire(&dcache.lock);
+  for(e = dcache.ent; e < &dcache.ent[NDENTRY]; e++)
+    if(e->dir == inum && e->dev == dev)
+      dcunlink(e);
+  release(&dcache.lock);
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
@@ -515,24 +1368,35 @@ dirlookup(struct inode *dp, char *name, uint *poff)
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      continue;
-    if(namecmp(name, de.name) == 0){
-      // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+  // The cache does not know offsets.
+  if(poff == 0 && dcget(dp, name, &inum))
+    return inum ? iget(dp->dev, inum) : 0;
+
+  inum = 0;
+  if(dxindexed(dp))
+    inum = dxlookup(dp, name, poff);
+  else {
+    for(off = 0; off < dp->size; off += sizeof(de)){
+      if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlink read");
+      if(de.inum == 0)
+        continue;
+      if(namecmp(name, de.name) == 0){
+        // entry matches path element
+        if(poff)
+          *poff = off;
+        inum = de.inum;
+        break;
+      }
     }
   }
 
-  return 0;
+  dcput(dp, name, inum);
+  return inum ? iget(dp->dev, inum) : 0;
 }
 
 // Write a new directory entry (name, inum) into the directory dp.
+// Returns -1 if name is already there or dp is full.
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
@@ -546,22 +1410,46 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
-  }
+  if(dxindexed(dp)){
+    if(dxlink(dp, name, inum) < 0)
+      return -1;
+  } else {
+    // Look for an empty dirent.
+    for(off = 0; off < dp->size; off += sizeof(de)){
+      if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlink read");
+      if(de.inum == 0)
+        break;
+    }
 
-  strncpy(de.name, name, DIRSIZ);
-  de.inum = inum;
-  if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-    panic("dirlink");
+    // Index a directory when it outgrows its first block.
+    if(off == BSIZE && dp->size == BSIZE && dxconvert(dp) == 0){
+      if(dxlink(dp, name, inum) < 0)
+        return -1;
+    } else {
+      strncpy(de.name, name, DIRSIZ);
+      de.inum = inum;
+      if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+        return -1;
+    }
+  }
 
+  dcput(dp, name, inum);
   return 0;
 }
 
+// Remove the entry for name, at offset off, from directory dp.
+void
+dirunlink(struct inode *dp, char *name, uint off)
+{
+  struct dirent de;
+
+  memset(&de, 0, sizeof(de));
+  if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
+    panic("dirunlink");
+  dcput(dp, name, 0);
+}
+
 //PAGEBREAK!
 // Paths
 
@@ -3,7 +3,12 @@
 
 
 #define ROOTINO 1  // root i-number
-#define BSIZE 512  // block size
+#ifndef BSIZE
+#define BSIZE 512  // block size; see BSIZE in the Makefile
+#endif
+#if BSIZE % 512 || BSIZE > 4096
+#error "BSIZE must be a multiple of 512 no larger than a page"
+#endif
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
@@ -19,11 +24,22 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint version;      // On-disk format, FSVERSION
+  uint bsize;        // Block size, BSIZE
 };
 
-#define NDIRECT 12
+#define FSVERSION 3  // extent-based inodes, up to triple-indirect
+
+// A run of consecutive disk blocks holding part of a file.
+struct extent {
+  uint start;  // first block
+  uint len;    // number of blocks, 0 if unused
+};
+
+#define NEXTENT 5
+#define NINDEXT (BSIZE / sizeof(struct extent))
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define MAXFILE (0xFFFFFFFF / BSIZE)  // limited by the size field
 
 // On-disk inode structure
 struct dinode {
@@ -32,9 +48,14 @@ struct dinode {
   short minor;          // Minor device number (T_DEV only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  struct extent ext[NEXTENT];  // Data block extents
+  uint indirect;        // Block holding NINDEXT more extents
+  uint dindirect;       // Block listing NINDIRECT more such blocks
+  uint tindirect;       // Block listing NINDIRECT blocks like dindirect
 };
 
+#define MAXINODE 65536  // inode numbers must fit in a dirent
+
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
@@ -44,6 +65,10 @@ struct dinode {
 // Bitmap bits per block
 #define BPB           (BSIZE*8)
 
+// Most bitmap blocks the kernel keeps free counts for
+// (one page of ushorts).
+#define MAXBGROUP     2048
+
 // Block of free map containing bit for block b
 #define BBLOCK(b, sb) (b/BPB + sb.bmapstart)
 
@@ -55,3 +80,29 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// A directory that outgrows its first block is indexed by
+// a hash of each name.  Block 0 keeps "." and "..", then a
+// dxhead and the root's entries; a deeper index block holds
+// a dxhead and more entries.  Each entry gives the smallest
+// hash stored under a child block: a leaf of dirents or, if
+// the root's depth is 1, another index block.  Index slots
+// start with a zero inum, so programs that read the
+// directory see them as empty dirents.
+#define DXMAGIC 0x78646978
+
+struct dxhead {
+  ushort zero;
+  ushort depth;  // block 0 only: levels of index blocks below
+  uint magic;    // DXMAGIC
+  uint count;    // entries in use
+  uint unused;
+};
+
+struct dxentry {
+  ushort zero;
+  ushort unused;
+  uint hash;     // smallest hash under block
+  uint block;    // child, as a block number within the directory
+  uint unused2;
+};
+
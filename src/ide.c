@@ -1,4 +1,5 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// Simple IDE driver code.  Uses bus-master DMA if the PCI IDE
+// controller supports it, and programmed I/O otherwise.
 
 #include "types.h"
 #include "defs.h"
@@ -22,16 +23,52 @@
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_SETMUL 0xc6
+#define IDE_CMD_RDDMA 0xc8
+#define IDE_CMD_WRDMA 0xca
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
+#define IDE_MULT      16   // sectors per READ/WRITE MULTIPLE
+
+// Bus-master DMA registers, from the PCI IDE controller's BAR4.
+#define BM_CMD        0
+#define BM_STATUS     2
+#define BM_PRDT       4
+#define BM_START      0x01
+#define BM_READ       0x08  // device to memory
+#define BM_ERR        0x02
+#define BM_INTR       0x04
+
+// Physical region descriptor: one buffer of a DMA transfer.
+struct prd {
+  uint addr;
+  ushort len;
+  ushort flags;
+};
+#define PRD_EOT       0x8000  // last descriptor
+#define NPRD          16      // blocks per DMA command
+
+// ideactive points to the bufs now being read/written to the disk,
+// a run of consecutive blocks chained through qnext.
+// idequeue holds the bufs waiting their turn, sorted in C-SCAN
+// order: ascending block numbers starting at idepos, the block
+// after the last one started, then wrapping around to the lowest.
+// idetail is the last buf in idequeue.
 // You must hold idelock while manipulating queue.
 
 static struct spinlock idelock;
+static struct buf *ideactive;
 static struct buf *idequeue;
+static struct buf *idetail;
+static uint idepos;
 
 static int havedisk1;
-static void idestart(struct buf*);
+static int havevirtio;  // disk 1 is a virtio disk
+static int idemult[2];  // blocks per command, if multiple mode is on
+static ushort idebm;    // bus-master registers, 0 if no DMA
+
+// The table must not cross a 64KB boundary.
+static struct prd prdt[NPRD] __attribute__((__aligned__(128)));
+static void idestart(void);
 
 // Wait for IDE disk to become ready.
 static int
@@ -49,6 +86,7 @@ idewait(int checkerr)
 void
 ideinit(void)
 {
+  uint tag, class, bar;
   int i;
 
   initlock(&idelock, "ide");
@@ -65,35 +103,101 @@ ideinit(void)
     }
   }
 
+  // Turn on multiple mode, so that one command can move
+  // several blocks with one interrupt.  Poll, with the
+  // interrupt masked.
+  outb(0x3f6, 2);
+  for(i=0; i<=havedisk1; i++){
+    outb(0x1f6, 0xe0 | (i<<4));
+    outb(0x1f2, IDE_MULT);
+    outb(0x1f7, IDE_CMD_SETMUL);
+    if(idewait(1) >= 0 && IDE_MULT >= BSIZE/SECTOR_SIZE)
+      idemult[i] = IDE_MULT / (BSIZE/SECTOR_SIZE);
+  }
+
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0<<4));
+
+  // Use DMA if there is a PCI IDE controller that can be
+  // bus master, with its primary channel at the ports above.
+  if(pcifindclass(0x01, 0x01, &tag) == 0){
+    class = pciread(tag, 0x08);
+    bar = pciread(tag, 0x20);
+    if((class & 0x8000) && !(class & 0x100) && (bar & 1)){
+      pciwrite(tag, 0x04, (pciread(tag, 0x04) & 0xFFFF) | 0x5);
+      idebm = bar & 0xFFFC;
+    }
+  }
+
+  havevirtio = virtioinit() == 0;
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Start the request at the head of idequeue, merged with
+// the bufs after it that continue it on the disk.
+// Caller must hold idelock.
 static void
-idestart(struct buf *b)
+idestart(void)
 {
-  if(b == 0)
+  struct buf *b, *last, *nb;
+  int n, max;
+
+  if((b = idequeue) == 0)
     panic("idestart");
-  if(b->blockno >= FSSIZE)
-    panic("incorrect blockno");
   int sector_per_block =  BSIZE/SECTOR_SIZE;
   int sector = b->blockno * sector_per_block;
+  if(b->blockno >= (1<<28) / sector_per_block)
+    panic("incorrect blockno");  // beyond 28-bit LBA
   int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
   int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
 
-  if (sector_per_block > 7) panic("idestart");
+  max = 1;
+  if(idebm){
+    max = NPRD;
+    read_cmd = IDE_CMD_RDDMA;
+    write_cmd = IDE_CMD_WRDMA;
+  } else if(idemult[b->dev&1]){
+    max = idemult[b->dev&1];
+    read_cmd = IDE_CMD_RDMUL;
+    write_cmd = IDE_CMD_WRMUL;
+  }
+  n = 1;
+  for(last = b; n < max && (nb = last->qnext) != 0; last = nb, n++){
+    if(nb->dev != b->dev || nb->blockno != last->blockno+1 ||
+       (nb->flags & B_DIRTY) != (b->flags & B_DIRTY))
+      break;
+  }
+  idequeue = last->qnext;
+  if(idequeue == 0)
+    idetail = 0;
+  last->qnext = 0;
+  ideactive = b;
+  idepos = last->blockno + 1;
+
+  if(idebm){
+    for(n = 0, nb = b; nb; nb = nb->qnext, n++){
+      prdt[n].addr = V2P(nb->data);
+      prdt[n].len = BSIZE;
+      prdt[n].flags = nb->qnext ? 0 : PRD_EOT;
+    }
+    outl(idebm+BM_PRDT, V2P(prdt));
+    outb(idebm+BM_STATUS, BM_ERR|BM_INTR);
+    outb(idebm+BM_CMD, (b->flags & B_DIRTY) ? 0 : BM_READ);
+  }
 
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  outb(0x1f2, n*sector_per_block);  // number of sectors
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
-  if(b->flags & B_DIRTY){
+  if(idebm){
+    outb(0x1f7, (b->flags & B_DIRTY) ? write_cmd : read_cmd);
+    outb(idebm+BM_CMD, inb(idebm+BM_CMD) | BM_START);
+  } else if(b->flags & B_DIRTY){
     outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE/4);
+    for(; b; b = b->qnext)
+      outsl(0x1f0, b->data, BSIZE/4);
   } else {
     outb(0x1f7, read_cmd);
   }
@@ -103,65 +207,88 @@ idestart(struct buf *b)
 void
 ideintr(void)
 {
-  struct buf *b;
+  struct buf *b, *nb;
+  int ok;
 
-  // First queued buffer is the active request.
   acquire(&idelock);
-  if((b = idequeue) == 0){
+  if((b = ideactive) == 0){
     release(&idelock);
     // cprintf("spurious IDE interrupt\n");
     return;
   }
-  idequeue = b->qnext;
+  ideactive = 0;
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+  ok = 1;
+  if(idebm){
+    outb(idebm+BM_CMD, 0);
+    if(inb(idebm+BM_STATUS) & BM_ERR)
+      ok = 0;
+    outb(idebm+BM_STATUS, BM_ERR|BM_INTR);
+  }
+  if(idewait(1) < 0)
+    ok = 0;
+  for(; b; b = nb){
+    nb = b->qnext;
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+    // Read data if needed.
+    if(!(b->flags & B_DIRTY) && !idebm && ok)
+      insl(0x1f0, b->data, BSIZE/4);
+
+    biodone(b);  // wake or release b
+  }
 
   // Start disk on next buf in queue.
   if(idequeue != 0)
-    idestart(idequeue);
+    idestart();
 
   release(&idelock);
 }
 
 //PAGEBREAK!
-// Sync buf with disk.
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// Start I/O on bufs, which are all for the same disk,
+// and return without waiting.
+// If B_DIRTY is set, write buf to disk, else read it.
+// Calls biodone(b) as each one finishes.
 void
-iderw(struct buf *b)
+idesubmit(struct buf **bufs, int n)
 {
-  struct buf **pp;
+  struct buf *b, **pp;
+  int i;
 
-  if(!(b->flags & B_BUSY))
-    panic("iderw: buf not busy");
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
-  if(b->dev != 0 && !havedisk1)
-    panic("iderw: ide disk 1 not present");
+  if(n <= 0)
+    return;
+  if(bufs[0]->dev == 1 && havevirtio){
+    virtiosubmit(bufs, n);
+    return;
+  }
+  if(bufs[0]->dev != 0 && !havedisk1)
+    panic("idesubmit: ide disk 1 not present");
 
   acquire(&idelock);  //DOC:acquire-lock
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
-  *pp = b;
-
-  // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
-
-  // Wait for request to finish.
-  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
-    sleep(b, &idelock);
+  // Insert each buf into idequeue, in C-SCAN order.
+  // Subtracting idepos makes blocks behind the head sort
+  // last.  Most requests go at the tail, so check that first.
+  for(i = 0; i < n; i++){
+    b = bufs[i];
+    b->qnext = 0;
+    if(idequeue == 0)
+      idequeue = idetail = b;
+    else if(b->blockno - idepos >= idetail->blockno - idepos){
+      idetail->qnext = b;
+      idetail = b;
+    } else {
+      for(pp=&idequeue; (*pp)->blockno - idepos <= b->blockno - idepos; pp=&(*pp)->qnext)  //DOC:insert-queue
+        ;
+      b->qnext = *pp;
+      *pp = b;
+    }
   }
 
+  // Start disk if necessary.  The whole batch is queued
+  // by now, so it can be merged.
+  if(ideactive == 0)
+    idestart();
+
   release(&idelock);
 }
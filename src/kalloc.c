@@ -11,15 +11,20 @@
 
 void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
+uint phystop;      // top of physical memory; set by main()
 
 struct run {
   struct run *next;
 };
 
+#define NZERO 256  // maximum number of pages in the pre-zeroed pool
+
 struct {
   struct spinlock lock;
   int use_lock;
   struct run *freelist;
+  struct run *zerolist;  // pages already filled with zeros
+  int nzero;             // length of zerolist
 } kmem;
 
 // Initialization happens in two phases.
@@ -61,7 +66,7 @@ kfree(char *v)
 {
   struct run *r;
 
-  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+  if((uint)v % PGSIZE || v < end || V2P(v) >= phystop)
     panic("kfree");
 
   // Fill with junk to catch dangling refs.
@@ -89,8 +94,70 @@ kalloc(void)
   r = kmem.freelist;
   if(r)
     kmem.freelist = r->next;
+  else if((r = kmem.zerolist) != 0){
+    kmem.zerolist = r->next;
+    kmem.nzero--;
+  }
+  if(kmem.use_lock)
+    release(&kmem.lock);
+  return (char*)r;
+}
+
+// Allocate one 4096-byte page filled with zeros.
+// Takes a page from the pre-zeroed pool if there is one,
+// so that the caller does not pay for the memset.
+// Returns 0 if the memory cannot be allocated.
+char*
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  r = kmem.zerolist;
+  if(r){
+    kmem.zerolist = r->next;
+    kmem.nzero--;
+  }
   if(kmem.use_lock)
     release(&kmem.lock);
+
+  if(r){
+    r->next = 0;  // the only non-zero word
+    return (char*)r;
+  }
+  if((r = (struct run*)kalloc()) != 0)
+    memset(r, 0, PGSIZE);
   return (char*)r;
 }
 
+// Move one page from the free list to the pre-zeroed pool,
+// unless the pool is full.  Called by the scheduler when
+// there is nothing to run, so that zeroing happens off the
+// critical path of allocuvm() and friends.
+void
+kzeroidle(void)
+{
+  struct run *r;
+
+  // Other CPUs reach the scheduler before kinit2() is done.
+  if(!kmem.use_lock)
+    return;
+
+  acquire(&kmem.lock);
+  if(kmem.nzero >= NZERO || (r = kmem.freelist) == 0){
+    release(&kmem.lock);
+    return;
+  }
+  kmem.freelist = r->next;
+  release(&kmem.lock);
+
+  memset(r, 0, PGSIZE);
+
+  acquire(&kmem.lock);
+  r->next = kmem.zerolist;
+  kmem.zerolist = r;
+  kmem.nzero++;
+  release(&kmem.lock);
+}
+
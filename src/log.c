@@ -1,6 +1,8 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
+#include "proc.h"
 #include "spinlock.h"
 #include "fs.h"
 #include "buf.h"
@@ -14,35 +16,99 @@
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// its start and end. begin_op() reserves room in the
+// transaction for MAXOPBLOCKS blocks; a call that writes
+// more says how many it needs with begin_opn(n). Usually
+// begin_op() just adds to the count of in-progress FS system
+// calls and returns. But if the transaction would run out
+// of room, it sleeps until the last outstanding end_op()
+// commits.
+//
+// The log is double-buffered.  A commit first copies the
+// transaction's blocks out of the cache into private staging
+// buffers, which takes no disk I/O; from then on FS system
+// calls can run again and fill the next transaction while the
+// commit writes the staged blocks to the log.  If the next
+// transaction is complete by the time the commit finishes,
+// the same process commits it too.
+//
+// Committed blocks are not installed at their home locations
+// right away.  The log is circular, and transactions are
+// appended to it until the next one doesn't fit; only then are
+// all the logged blocks installed at once (a checkpoint), and
+// the log emptied.  The staging buffers hold the latest
+// committed copy of each logged block until the checkpoint, so
+// a block that several transactions modify is installed once.
+// A logged block stays pinned in the cache (B_DIRTY) until it
+// has been installed, since its home copy is stale until then.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
-//   block A
-//   block B
-//   block C
-//   ...
-// Log appends are synchronous.
-
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+//   header block, containing where the oldest transaction
+//     that is not installed starts, and its sequence number
+//   then a ring of transactions, each:
+//     descriptor: sequence number, block #s for A, B, C, ...
+//       (as many blocks as it takes)
+//     block A
+//     block B
+//     block C
+//     ...
+// The first descriptor block is written after all the others;
+// it is the true point at which the transaction commits.
+// A logged block that itself starts with LOGMAGIC (file data
+// can say anything) is written to the ring with its first word
+// zeroed and LOGESC set in its block #, so that recovery can
+// never mistake a stale copy of it for a descriptor.
+// The size of the log is chosen by mkfs.
+// Recovery replays transactions from the header's position as
+// long as their descriptors carry the expected sequence numbers.
+
+#define LOGMAGIC 0x6c6f6721  // marks a descriptor
+#define LOGESC   0x80000000  // block # flag: first word was LOGMAGIC
+#define NHASH    1021        // staged block hash chains
+
+// A descriptor is an array of words: LOGMAGIC, sequence
+// number, n, then n block #s, DPB words per block.
+#define DPB       (BSIZE/sizeof(uint))
+#define NDESC(n)  (((n) + 3 + DPB-1) / DPB)
+
+// Block numbers of a transaction in memory.
 struct logheader {
   int n;
   int block[LOGSIZE];
 };
 
+// On-disk header block.
+struct loghead {
+  int tail;   // position of the oldest transaction not installed
+  uint seq;   // its sequence number
+};
+
 struct log {
   struct spinlock lock;
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // blocks they have reserved.
+  int maxtrans;    // max blocks in a transaction
+  int committing;  // copying out a transaction, please wait.
+  int writing;     // a commit's disk writes are in progress.
   int dev;
-  struct logheader lh;
+  struct logheader lh;   // transaction being filled
+  struct logheader clh;  // transaction being committed
+
+  // The ring, of size-1 blocks after the header.
+  int tail;        // oldest transaction not installed
+  int head;        // where the next transaction goes
+  int used;        // blocks between tail and head
+  uint seq;        // sequence number of the next transaction
+
+  // Staged blocks, stage[0..nstage-1], each the latest
+  // committed (or committing) copy of its home block.
+  struct buf *stage[MAXLOG];
+  int nstage;
+  struct buf *hash[NHASH];   // staged blocks by home block #
+  struct buf *txn[LOGSIZE];  // clh's staged blocks
 };
 struct log log;
 
@@ -52,8 +118,10 @@ static void commit();
 void
 initlog(int dev)
 {
-  if (sizeof(struct logheader) >= BSIZE)
-    panic("initlog: too big logheader");
+  struct kmem_cache *cache;
+  struct buf *b;
+  uchar *data;
+  int i;
 
   struct superblock sb;
   initlock(&log.lock, "log");
@@ -61,78 +129,180 @@ initlog(int dev)
   log.start = sb.logstart;
   log.size = sb.nlog;
   log.dev = dev;
+  if (log.size > MAXLOG)
+    panic("initlog: log too big");
+
+  // The largest transaction that fits in the ring.
+  log.maxtrans = LOGSIZE;
+  while (log.maxtrans > 0 &&
+        NDESC(log.maxtrans) + log.maxtrans > log.size - 1)
+    log.maxtrans--;
+  if (log.maxtrans < MAXOPBLOCKS)
+    panic("initlog: log too small");
+
+  // Logged blocks stay in the cache until installed: those
+  // in the ring, and the transaction being filled.
+  breserve(log.size + log.maxtrans);
+
+  // Staging buffers are not in the buffer cache.
+  if ((cache = kmem_cache_create("logbuf", sizeof(struct buf))) == 0)
+    panic("initlog: out of memory");
+  data = 0;
+  for (i = 0; i < log.size; i++) {
+    if (i % (PGSIZE/BSIZE) == 0 && (data = (uchar*)kalloc()) == 0)
+      panic("initlog: out of memory");
+    if ((b = kmem_cache_alloc(cache)) == 0)
+      panic("initlog: out of memory");
+    memset(b, 0, sizeof(*b));
+    b->dev = dev;
+    b->data = data + (i % (PGSIZE/BSIZE))*BSIZE;
+    log.stage[i] = b;
+  }
   recover_from_log();
 }
 
-// Copy committed blocks from log to their home location
-static void
-install_trans(void)
+// Max blocks one FS system call can reserve.
+int
+log_maxop(void)
 {
-  int tail;
+  return log.maxtrans;
+}
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    brelse(lbuf);
-    brelse(dbuf);
-  }
+// Disk block of ring position i.
+static int
+logblock(int i)
+{
+  return log.start + 1 + i % (log.size - 1);
 }
 
-// Read the log header from disk into the in-memory log header
+// Write bufs to disk, at log position pos onward if
+// tolog is set, else at the home locations in block[].
 static void
-read_head(void)
+write_stage(struct buf **bufs, int n, int *block, int tolog, int pos)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+
+  for (i = 0; i < n; i++) {
+    bufs[i]->blockno = tolog ? logblock(pos+i) : block[i];
+    bufs[i]->flags = B_BUSY|B_VALID|B_DIRTY;
   }
-  brelse(buf);
+  bsubmit(bufs, n);
+  bwait(bufs, n);
+  for (i = 0; i < n; i++)
+    bufs[i]->blockno = block[i];
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Write the log header: the ring holds nothing
+// before position tail, whose sequence number is seq.
 static void
-write_head(void)
+write_head(int tail, uint seq)
 {
   struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
-  int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
-  }
+  struct loghead *hb = (struct loghead *) (buf->data);
+  hb->tail = tail;
+  hb->seq = seq;
   bwrite(buf);
   brelse(buf);
 }
 
+// Read the descriptor at ring position pos into clh.
+// Returns 0 if it is the transaction numbered seq.
+static int
+read_desc(int pos, uint seq)
+{
+  struct buf *buf;
+  uint *w;
+  int i, n;
+
+  buf = bread(log.dev, logblock(pos));
+  w = (uint*)buf->data;
+  n = w[2];
+  if (w[0] != LOGMAGIC || w[1] != seq || n < 0 || n > log.maxtrans) {
+    brelse(buf);
+    return -1;
+  }
+  log.clh.n = n;
+  for (i = 0; i < n; i++) {
+    if ((i+3) % DPB == 0) {
+      brelse(buf);
+      buf = bread(log.dev, logblock(pos + (i+3)/DPB));
+      w = (uint*)buf->data;
+    }
+    log.clh.block[i] = w[(i+3) % DPB];
+  }
+  brelse(buf);
+  return 0;
+}
+
+// Replay every committed transaction in the ring onto the
+// home locations, then empty the ring.  Nothing has read the
+// blocks into the cache yet, so they can go straight to disk.
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct buf *buf;
+  struct loghead *lh;
+  int i, pos;
+  uint seq;
+
+  buf = bread(log.dev, log.start);
+  lh = (struct loghead *) (buf->data);
+  pos = lh->tail;
+  seq = lh->seq;
+  brelse(buf);
+  if (pos < 0 || pos >= log.size - 1)
+    pos = 0;
+
+  while (read_desc(pos, seq) == 0) {
+    pos += NDESC(log.clh.n);
+    for (i = 0; i < log.clh.n; i++) {
+      log.stage[i]->blockno = logblock(pos+i);
+      log.stage[i]->flags = B_BUSY;
+    }
+    bsubmit(log.stage, log.clh.n);  // read log blocks
+    bwait(log.stage, log.clh.n);
+    for (i = 0; i < log.clh.n; i++) {
+      if (log.clh.block[i] & LOGESC) {
+        log.clh.block[i] &= ~LOGESC;
+        ((uint*)log.stage[i]->data)[0] = LOGMAGIC;
+      }
+    }
+    write_stage(log.stage, log.clh.n, log.clh.block, 0, 0);
+    pos = (pos + log.clh.n) % (log.size - 1);
+    seq++;
+  }
+  log.clh.n = 0;
+  log.tail = log.head = pos;
+  log.seq = seq;
+  write_head(pos, seq); // clear the log
 }
 
 // called at the start of each FS system call.
 void
 begin_op(void)
 {
+  begin_opn(MAXOPBLOCKS);
+}
+
+// called at the start of an FS system call that
+// may write up to n blocks.
+void
+begin_opn(int n)
+{
+  if(n > log.maxtrans)
+    panic("begin_opn: too big");
   acquire(&log.lock);
   while(1){
     if(log.committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.lh.n + log.reserved + n > log.maxtrans){
       // this op might exhaust log space; wait for commit.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.reserved += n;
+      proc->logres = n;
+      proc->logused = 0;
       release(&log.lock);
       break;
     }
@@ -140,7 +310,9 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation,
+// unless a commit is already writing, in which case
+// that commit will pick this transaction up.
 void
 end_op(void)
 {
@@ -148,11 +320,15 @@ end_op(void)
 
   acquire(&log.lock);
   log.outstanding -= 1;
+  log.reserved -= proc->logres;
+  proc->logres = 0;
+  proc->logused = 0;
   if(log.committing)
     panic("log.committing");
-  if(log.outstanding == 0){
+  if(log.outstanding == 0 && !log.writing){
     do_commit = 1;
     log.committing = 1;
+    log.writing = 1;
   } else {
     // begin_op() may be waiting for log space.
     wakeup(&log);
@@ -163,44 +339,200 @@ end_op(void)
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit();
+  }
+}
+
+// How many more blocks the current FS system call may
+// write without going over what it reserved.
+int
+log_room(void)
+{
+  return proc->logres - proc->logused;
+}
+
+// Let the current FS system call's updates so far commit,
+// and carry on in a new operation with the same room, for
+// work too big for one transaction.  The caller must not
+// hold buffers, or inode locks that another operation
+// might be waiting for, since this may wait for a commit.
+void
+restart_op(void)
+{
+  int n;
+
+  n = proc->logres;
+  if(n < MAXOPBLOCKS)
+    n = MAXOPBLOCKS;
+  end_op();
+  begin_opn(n);
+}
+
+// Install every staged block at its home location, and
+// empty the ring.  Then unpin the blocks in the cache,
+// except those the transaction being filled has modified
+// again.  Only the committing process calls checkpoint(),
+// so the staging buffers can't change under it.
+static void
+checkpoint(void)
+{
+  struct buf *b;
+  int i, j;
+
+  if (log.nstage == 0)
+    return;
+  for (i = 0; i < log.nstage; i++)
+    log.stage[i]->flags = B_BUSY|B_VALID|B_DIRTY;
+  bsubmit(log.stage, log.nstage);  // write all to home locations
+  bwait(log.stage, log.nstage);
+  log.tail = log.head;
+  log.used = 0;
+  write_head(log.tail, log.seq);
+
+  for (i = 0; i < log.nstage; i++) {
+    // Holding b keeps log_write() from pinning it meanwhile.
+    b = bread(log.dev, log.stage[i]->blockno);
     acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
+    for (j = 0; j < log.lh.n; j++) {
+      if (log.lh.block[j] == b->blockno)
+        break;
+    }
+    if (j == log.lh.n)
+      b->flags &= ~B_DIRTY;
     release(&log.lock);
+    brelse(b);
   }
+  log.nstage = 0;
+  memset(log.hash, 0, sizeof(log.hash));
 }
 
-// Copy modified blocks from cache to log.
+// Copy the blocks of the current transaction out of the
+// cache into the staging buffers, and start a new one.
+// A block that is already staged from an earlier transaction
+// is overwritten, absorbing the earlier write.
+// Caller has set log.committing, so no FS system calls
+// are running.
 static void
-write_log(void)
+stage_trans(void)
 {
-  int tail;
+  struct buf *b, *s;
+  int i, h;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  // Make room in the ring for the descriptor and blocks.
+  if (log.used + NDESC(log.lh.n) + log.lh.n > log.size - 1)
+    checkpoint();
+
+  log.clh = log.lh;
+  for (i = 0; i < log.clh.n; i++) {
+    h = log.clh.block[i] % NHASH;
+    for (s = log.hash[h]; s; s = s->hnext)
+      if (s->blockno == log.clh.block[i])
+        break;
+    if (s == 0) {
+      s = log.stage[log.nstage++];
+      s->blockno = log.clh.block[i];
+      s->hnext = log.hash[h];
+      log.hash[h] = s;
+    }
+    b = bread(log.dev, log.clh.block[i]);  // pinned, so cached
+    memmove(s->data, b->data, BSIZE);
+    brelse(b);
+    log.txn[i] = s;
   }
+  log.lh.n = 0;
+}
+
+// Append the staged transaction to the ring: the blocks
+// and the descriptor, whose first block goes last.
+static void
+write_trans(void)
+{
+  struct buf *d[NDESC(LOGSIZE)];
+  uint blocknos[NDESC(LOGSIZE)];
+  int i, k, n;
+  uint w;
+
+  // The descriptor is written whole, so don't read
+  // the old contents of its ring slots.
+  n = log.clh.n;
+  k = NDESC(n);
+  for (i = 0; i < k; i++)
+    blocknos[i] = logblock(log.head+i);
+  bgetn(log.dev, blocknos, d, k);
+  for (i = 0; i < k; i++) {
+    memset(d[i]->data, 0, BSIZE);
+    d[i]->flags |= B_VALID;
+  }
+  for (i = 0; i < n+3; i++) {
+    if (i == 0)
+      w = LOGMAGIC;
+    else if (i == 1)
+      w = log.seq;
+    else if (i == 2)
+      w = n;
+    else
+      w = log.clh.block[i-3];
+    ((uint*)d[i/DPB]->data)[i%DPB] = w;
+  }
+  for (i = 0; i < n; i++) {
+    if (((uint*)log.txn[i]->data)[0] == LOGMAGIC) {
+      ((uint*)log.txn[i]->data)[0] = 0;
+      ((uint*)d[(i+3)/DPB]->data)[(i+3)%DPB] |= LOGESC;
+    }
+  }
+  for (i = 1; i < k; i++)
+    d[i]->flags |= B_DIRTY;
+  bsubmit(d+1, k-1);
+  write_stage(log.txn, n, log.clh.block, 1, log.head+k);
+  bwait(d+1, k-1);
+  for (i = 0; i < n; i++)
+    if (((uint*)d[(i+3)/DPB]->data)[(i+3)%DPB] & LOGESC)
+      ((uint*)log.txn[i]->data)[0] = LOGMAGIC;
+  bwrite(d[0]);  // the real commit
+  for (i = 0; i < k; i++)
+    brelse(d[i]);
+
+  log.head = (log.head + k + n) % (log.size - 1);
+  log.used += k + n;
+  log.seq++;
 }
 
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  for(;;){
+    stage_trans();
+    acquire(&log.lock);
+    log.committing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    if (log.clh.n > 0) {
+      write_trans();   // Write staged blocks and descriptor to log
+      log.clh.n = 0;
+    }
+
+    // Install once the ring is half full, while FS system
+    // calls run, so that stage_trans() rarely has to.
+    if (log.used > (log.size - 1) / 2)
+      checkpoint();
+
+    // Commit the next transaction too if it is complete.
+    acquire(&log.lock);
+    if(log.outstanding == 0 && log.lh.n > 0){
+      log.committing = 1;
+      release(&log.lock);
+      continue;
+    }
+    log.writing = 0;
+    wakeup(&log);
+    release(&log.lock);
+    break;
   }
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache with B_DIRTY.
-// commit()/write_log() will do the disk write.
+// commit() will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -212,7 +544,7 @@ log_write(struct buf *b)
 {
   int i;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.maxtrans)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -223,8 +555,10 @@ log_write(struct buf *b)
       break;
   }
   log.lh.block[i] = b->blockno;
-  if (i == log.lh.n)
+  if (i == log.lh.n) {
     log.lh.n++;
+    proc->logused++;
+  }
   b->flags |= B_DIRTY; // prevent eviction
   release(&log.lock);
 }
@@ -8,6 +8,8 @@
 
 static void startothers(void);
 static void mpmain(void)  __attribute__((noreturn));
+static void meminit(void);
+static void freemem(void);
 extern pde_t *kpgdir;
 extern char end[]; // first address after kernel loaded from ELF file
 
@@ -19,6 +21,7 @@ extern char end[]; // first address after kernel loaded from ELF file
 int
 main(void)
 {
+  meminit();       // find physical memory
   kinit1(end, P2V(4*1024*1024)); // phys page allocator
   kvmalloc();      // kernel page table
   mpinit();        // detect other processors
@@ -29,15 +32,17 @@ main(void)
   ioapicinit();    // another interrupt controller
   consoleinit();   // console hardware
   uartinit();      // serial port
+  slabinit();      // kernel object allocator
   pinit();         // process table
   tvinit();        // trap vectors
-  binit();         // buffer cache
   fileinit();      // file table
+  pipeinit();      // pipe buffers
   ideinit();       // disk
   if(!ismp)
     timerinit();   // uniprocessor timer
   startothers();   // start other processors
-  kinit2(P2V(4*1024*1024), P2V(PHYSTOP)); // must come after startothers()
+  freemem();       // must come after startothers()
+  binit();         // buffer cache; uses memory from freemem()
   userinit();      // first user process
   mpmain();        // finish this processor's setup
 }
@@ -62,6 +67,102 @@ mpmain(void)
   scheduler();     // start running processes
 }
 
+//PAGEBREAK!
+// Physical memory discovery.
+
+#define E820_RAM 1  // usable memory
+#define MULTIBOOT_MAGIC 0x2badb002
+
+// Memory map entry, as left at E820MAP by bootasm.S.
+struct e820entry {
+  uint addr;
+  uint addrhi;
+  uint len;
+  uint lenhi;
+  uint type;
+};
+
+// Usable ranges of physical memory.
+static struct {
+  uint start;
+  uint end;
+} mem[E820MAX];
+static int nmem;
+
+extern uint mbmagic, mbinfo;  // saved by entry.S
+
+// Record [start, end) as usable, trimmed to whole pages
+// that the kernel can map.
+static void
+addmem(uint start, uint end)
+{
+  if(end > MAXPHYS)
+    end = MAXPHYS;
+  if(start >= end)
+    return;
+  start = PGROUNDUP(start);
+  end = PGROUNDDOWN(end);
+  if(start < end && nmem < E820MAX){
+    mem[nmem].start = start;
+    mem[nmem].end = end;
+    nmem++;
+  }
+}
+
+// Find the usable physical memory and set phystop to its top.
+// bootasm.S leaves the BIOS memory map at E820MAP; a multiboot
+// loader (which skips bootasm.S) instead passes the size of
+// extended memory in its information structure.  If neither
+// says anything, assume PHYSTOP.
+static void
+meminit(void)
+{
+  struct e820entry *e;
+  uint i, n, end, *mb;
+
+  if(mbmagic == MULTIBOOT_MAGIC){
+    // entrypgdir only maps the first 4MB.
+    mb = P2V(mbinfo);
+    if(mbinfo < 4*1024*1024 && (mb[0] & 1))  // flags: mem_upper valid
+      addmem(EXTMEM, EXTMEM + mb[2]*1024);
+  } else {
+    n = *(uint*)P2V(E820MAP);
+    e = (struct e820entry*)P2V(E820MAP+4);
+    for(i = 0; i < n && i < E820MAX; i++){
+      if(e[i].type != E820_RAM || e[i].addrhi != 0)
+        continue;
+      end = e[i].addr + e[i].len;
+      if(e[i].lenhi != 0 || end < e[i].addr)
+        end = MAXPHYS;
+      addmem(e[i].addr, end);
+    }
+  }
+  if(nmem == 0)
+    addmem(EXTMEM, PHYSTOP);
+
+  phystop = 0;
+  for(i = 0; i < nmem; i++)
+    if(mem[i].end > phystop)
+      phystop = mem[i].end;
+}
+
+// Give the usable memory above 4MB to the page allocator.
+// The memory below 4MB went to kinit1().
+static void
+freemem(void)
+{
+  uint i, start;
+
+  for(i = 0; i < nmem; i++){
+    start = mem[i].start;
+    if(start < 4*1024*1024)
+      start = 4*1024*1024;
+    if(start > mem[i].end)
+      start = mem[i].end;
+    kinit2(P2V(start), P2V(mem[i].end));
+  }
+}
+
 pde_t entrypgdir[];  // For entry.S
 
 // Start the non-boot (AP) processors.
@@ -31,29 +31,27 @@ ideintr(void)
   // no-op
 }
 
-// Sync buf with disk.
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// Do I/O on bufs, as idesubmit() does, but synchronously.
 void
-iderw(struct buf *b)
+idesubmit(struct buf **bufs, int n)
 {
+  struct buf *b;
   uchar *p;
-
-  if(!(b->flags & B_BUSY))
-    panic("iderw: buf not busy");
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
-  if(b->dev != 1)
-    panic("iderw: request not for disk 1");
-  if(b->blockno >= disksize)
-    panic("iderw: block out of range");
-
-  p = memdisk + b->blockno*BSIZE;
-
-  if(b->flags & B_DIRTY){
-    b->flags &= ~B_DIRTY;
-    memmove(p, b->data, BSIZE);
-  } else
-    memmove(b->data, p, BSIZE);
-  b->flags |= B_VALID;
+  int i;
+
+  for(i = 0; i < n; i++){
+    b = bufs[i];
+    if(b->dev != 1)
+      panic("idesubmit: request not for disk 1");
+    if(b->blockno >= disksize)
+      panic("idesubmit: block out of range");
+
+    p = memdisk + b->blockno*BSIZE;
+
+    if(b->flags & B_DIRTY)
+      memmove(p, b->data, BSIZE);
+    else
+      memmove(b->data, p, BSIZE);
+    biodone(b);
+  }
 }
@@ -1,12 +1,19 @@
 // Memory layout
 
 #define EXTMEM  0x100000            // Start of extended memory
-#define PHYSTOP 0xE000000           // Top physical memory
+#define PHYSTOP 0xE000000           // Top physical memory if the BIOS doesn't say
 #define DEVSPACE 0xFE000000         // Other devices are at high addresses
 
+// Physical memory map from the BIOS, left by bootasm.S for main():
+// a uint count followed by 20-byte E820 entries.
+#define E820MAP 0x8000
+#define E820MAX 32
+
 // Key addresses for address space layout (see kmap in vm.c for layout)
 #define KERNBASE 0x80000000         // First kernel virtual address
+#define MMAPBASE 0x40000000         // mmap regions live in MMAPBASE..KERNBASE
 #define KERNLINK (KERNBASE+EXTMEM)  // Address where kernel is linked
+#define MAXPHYS  (DEVSPACE-KERNBASE) // Most physical memory the kernel can map
 
 #define V2P(a) (((uint) (a)) - KERNBASE)
 #define P2V(a) (((void *) (a)) + KERNBASE)
@@ -20,15 +20,16 @@
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
 
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
-int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int fssize = FSSIZE;
+int ninodes = NINODES;
+int nbitmap;
+int ninodeblocks;
+int nlog = NLOG;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
 int fsfd;
 struct superblock sb;
-char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
 
@@ -39,6 +40,10 @@ void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
+uint extblock(struct dinode *din, uint n, int alloc);
+int rext(struct dinode *din, uint k, struct extent *e);
+void wext(struct dinode *din, uint k, struct extent *e);
+uint ibmap(struct dinode *din, uint fbn);
 void iappend(uint inum, void *p, int n);
 
 // convert to intel byte order
@@ -76,13 +81,28 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+  for(; argc > 2 && argv[1][0] == '-'; argc -= 2, argv += 2){
+    if(strcmp(argv[1], "-l") == 0)
+      nlog = atoi(argv[2]);
+    else if(strcmp(argv[1], "-s") == 0)
+      fssize = atoi(argv[2]);
+    else if(strcmp(argv[1], "-i") == 0)
+      ninodes = atoi(argv[2]);
+    else
+      break;
+  }
+  if(argc < 2 || argv[1][0] == '-' || nlog < 2 || nlog > MAXLOG ||
+     fssize <= 0 || ninodes < 2 || ninodes > MAXINODE){
+    fprintf(stderr, "Usage: mkfs [-l logblocks] [-s blocks] [-i inodes] fs.img files...\n");
     exit(1);
   }
+  nbitmap = fssize/(BSIZE*8) + 1;
+  ninodeblocks = ninodes / IPB + 1;
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
+  assert(sizeof(struct dxhead) == sizeof(struct dirent));
+  assert(sizeof(struct dxentry) == sizeof(struct dirent));
 
   fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
   if(fsfd < 0){
@@ -90,25 +110,37 @@ main(int argc, char *argv[])
     exit(1);
   }
 
-  // 1 fs block = 1 disk sector
+  // 1 fs block = BSIZE/512 disk sectors
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  if(nmeta >= fssize){
+    fprintf(stderr, "mkfs: file system too small\n");
+    exit(1);
+  }
+  if(fssize > MAXBGROUP*BPB){
+    fprintf(stderr, "mkfs: file system too big, at most %d blocks\n", MAXBGROUP*BPB);
+    exit(1);
+  }
+  nblocks = fssize - nmeta;
 
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
+  sb.ninodes = xint(ninodes);
   sb.nlog = xint(nlog);
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.version = xint(FSVERSION);
+  sb.bsize = xint(BSIZE);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+         nmeta, nlog, ninodeblocks, nbitmap, nblocks, fssize);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
+  if(ftruncate(fsfd, (off_t)fssize * BSIZE) < 0){
+    perror("ftruncate");
+    exit(1);
+  }
 
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
@@ -170,6 +202,10 @@ main(int argc, char *argv[])
 void
 wsect(uint sec, void *buf)
 {
+  if(sec >= fssize){
+    fprintf(stderr, "mkfs: file system full\n");
+    exit(1);
+  }
   if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE){
     perror("lseek");
     exit(1);
@@ -226,6 +262,7 @@ ialloc(ushort type)
   uint inum = freeinode++;
   struct dinode din;
 
+  assert(inum < ninodes);
   bzero(&din, sizeof(din));
   din.type = xshort(type);
   din.nlink = xshort(1);
@@ -238,20 +275,131 @@ void
 balloc(int used)
 {
   uchar buf[BSIZE];
-  int i;
+  int i, b;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE*8);
-  bzero(buf, BSIZE);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  for(b = 0; b < used; b += BPB){
+    bzero(buf, BSIZE);
+    for(i = 0; i < BPB && b + i < used; i++){
+      buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    }
+    printf("balloc: write bitmap block at sector %d\n", sb.bmapstart + b/BPB);
+    wsect(sb.bmapstart + b/BPB, buf);
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the address of extent block n of din, counting
+// din->indirect as 0, or 0 if it does not exist and alloc
+// is not set.
+uint
+extblock(struct dinode *din, uint n, int alloc)
+{
+  uint *root, addr, i;
+  uint a[NINDIRECT];
+  int level;
+
+  if(n == 0){
+    root = &din->indirect;
+    level = 0;
+  } else if((n -= 1) < NINDIRECT){
+    root = &din->dindirect;
+    level = 1;
+  } else {
+    n -= NINDIRECT;
+    assert(n < NINDIRECT*NINDIRECT);
+    root = &din->tindirect;
+    level = 2;
+  }
+
+  if(xint(*root) == 0){
+    if(!alloc)
+      return 0;
+    *root = xint(freeblock++);
+  }
+  addr = xint(*root);
+  for(; level > 0; level--){
+    rsect(addr, (char*)a);
+    i = level == 2 ? n / NINDIRECT : n % NINDIRECT;
+    if(xint(a[i]) == 0){
+      if(!alloc)
+        return 0;
+      a[i] = xint(freeblock++);
+      wsect(addr, (char*)a);
+    }
+    addr = xint(a[i]);
+  }
+  return addr;
+}
+
+// Read extent k of din into *e.  Returns 0 if the
+// extent block that would hold it does not exist.
+int
+rext(struct dinode *din, uint k, struct extent *e)
+{
+  struct extent buf[NINDEXT];
+  uint addr;
+
+  if(k < NEXTENT){
+    *e = din->ext[k];
+    return 1;
+  }
+  k -= NEXTENT;
+  if((addr = extblock(din, k / NINDEXT, 0)) == 0)
+    return 0;
+  rsect(addr, (char*)buf);
+  *e = buf[k % NINDEXT];
+  return 1;
+}
+
+// Write *e as extent k of din.
+void
+wext(struct dinode *din, uint k, struct extent *e)
+{
+  struct extent buf[NINDEXT];
+  uint addr;
+
+  if(k < NEXTENT){
+    din->ext[k] = *e;
+    return;
+  }
+  k -= NEXTENT;
+  addr = extblock(din, k / NINDEXT, 1);
+  rsect(addr, (char*)buf);
+  buf[k % NINDEXT] = *e;
+  wsect(addr, (char*)buf);
+}
+
+// Return the disk block holding block fbn of din, allocating
+// it if fbn is the first block past the end of the file.
+// Blocks are handed out in order, so a new block usually
+// just extends the file's last extent.
+uint
+ibmap(struct dinode *din, uint fbn)
+{
+  struct extent e;
+  uint k, x;
+
+  for(k = 0; rext(din, k, &e) && xint(e.len) != 0; k++){
+    if(fbn < xint(e.len))
+      return xint(e.start) + fbn;
+    fbn -= xint(e.len);
+  }
+  assert(fbn == 0);
+
+  x = freeblock++;
+  if(k > 0 && rext(din, k-1, &e) && xint(e.start) + xint(e.len) == x){
+    e.len = xint(xint(e.len) + 1);
+    wext(din, k-1, &e);
+  } else {
+    e.start = xint(x);
+    e.len = xint(1);
+    wext(din, k, &e);
+  }
+  return x;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -259,7 +407,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -267,23 +414,7 @@ iappend(uint inum, void *xp, int n)
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = ibmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
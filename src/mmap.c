@@ -0,0 +1,226 @@
+//
+// Mapping files into memory.
+//
+// mmap() only records a region of the address space between
+// MMAPBASE and KERNBASE, along with the file and offset it
+// maps.  The first touch of each page faults, and mmapfault()
+// fills a fresh page from the buffer cache with readi() and
+// maps it, read-only unless the region is PROT_WRITE.
+// Mappings are MAP_PRIVATE: pages written by the process stay
+// private to it and never reach the file, and fork() gives the
+// child its own copy of the pages touched so far.
+//
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+#include "stat.h"
+
+// Does [start, end) overlap a region of the current process?
+static int
+mmapused(uint start, uint end)
+{
+  struct vma *v;
+
+  for(v = proc->vma; v < &proc->vma[NMMAP]; v++)
+    if(v->f && start < v->end && v->start < end)
+      return 1;
+  return 0;
+}
+
+// Find room for len bytes, page-aligned, as high as possible
+// below KERNBASE: either at the top, or just below a region.
+// Returns the start of the room, or 0.
+static uint
+mmaproom(uint len)
+{
+  uint end, best;
+  int i;
+
+  best = 0;
+  for(i = -1; i < NMMAP; i++){
+    if(i < 0)
+      end = KERNBASE;
+    else if(proc->vma[i].f)
+      end = proc->vma[i].start;
+    else
+      continue;
+    if(end - MMAPBASE < len || end - len <= best)
+      continue;
+    if(!mmapused(end - len, end))
+      best = end - len;
+  }
+  return best;
+}
+
+// Return the region holding va, or 0.
+static struct vma*
+mmapfind(uint va)
+{
+  struct vma *v;
+
+  for(v = proc->vma; v < &proc->vma[NMMAP]; v++)
+    if(v->f && va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+// Make the page holding va present, reading it from the file
+// if it isn't yet.  Returns 0 if the current process may then
+// access it (write it, if write is set), and -1 if not.
+// Called on page faults, and by argptr() before the kernel
+// touches a region, so that the kernel itself never faults
+// while holding inode locks.
+int
+mmapfault(uint va, int write)
+{
+  struct vma *v;
+  struct inode *ip;
+  char *mem;
+  uint a, off;
+  int n;
+
+  if((v = mmapfind(va)) == 0)
+    return -1;
+  if(write && !(v->prot & PROT_WRITE))
+    return -1;
+  a = PGROUNDDOWN(va);
+  if(uva2ka(proc->pgdir, (char*)a) != 0)
+    return 0;
+
+  if((mem = kalloc_zeroed()) == 0)
+    return -1;
+  ip = v->f->ip;
+  off = v->off + (a - v->start);
+  ilock(ip);
+  n = 0;
+  if(off < ip->size)
+    n = readi(ip, mem, off, PGSIZE);
+  iunlock(ip);
+  if(n < 0 || mappages(proc->pgdir, (char*)a, PGSIZE, V2P(mem),
+                       (v->prot & PROT_WRITE) ? PTE_W|PTE_U : PTE_U) < 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Check that [va, va+n) lies in one region of the current
+// process, and make its pages present.
+int
+mmapcheck(uint va, uint n, int write)
+{
+  struct vma *v;
+  uint a;
+
+  if((v = mmapfind(va)) == 0 || n > v->end - va)
+    return -1;
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE)
+    if(mmapfault(a, write) < 0)
+      return -1;
+  return 0;
+}
+
+// Give np, a new child of the current process, the same
+// regions, with copies of the pages present so far.
+int
+mmapfork(struct proc *np)
+{
+  struct vma *v, *nv;
+
+  for(v = proc->vma, nv = np->vma; v < &proc->vma[NMMAP]; v++, nv++){
+    if(v->f == 0)
+      continue;
+    if(copypages(proc->pgdir, np->pgdir, v->start, v->end) < 0){
+      mmapclose(np);
+      return -1;
+    }
+    *nv = *v;
+    nv->f = filedup(v->f);
+  }
+  return 0;
+}
+
+// Forget all of p's regions.  The pages themselves belong to
+// p->pgdir and are freed with it.
+void
+mmapclose(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NMMAP]; v++){
+    if(v->f){
+      fileclose(v->f);
+      v->f = 0;
+    }
+  }
+}
+
+//PAGEBREAK!
+// Map len bytes of file fd, starting at off, into memory.
+// addr must be 0, and flags MAP_PRIVATE.
+int
+sys_mmap(void)
+{
+  int addr, len, prot, flags, fd, off;
+  struct file *f;
+  struct vma *v;
+  uint start;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argint(4, &fd) < 0 || argint(5, &off) < 0)
+    return -1;
+  if(addr != 0 || len <= 0 || off < 0 || off % PGSIZE != 0)
+    return -1;
+  if(flags != MAP_PRIVATE || (prot & ~(PROT_READ|PROT_WRITE)) != 0)
+    return -1;
+  if(fd < 0 || fd >= NOFILE || (f = proc->ofile[fd]) == 0)
+    return -1;
+  if(f->type != FD_INODE || !f->readable)
+    return -1;
+  ilock(f->ip);
+  if(f->ip->type != T_FILE){
+    iunlock(f->ip);
+    return -1;
+  }
+  iunlock(f->ip);
+
+  for(v = proc->vma; v < &proc->vma[NMMAP]; v++)
+    if(v->f == 0)
+      break;
+  if(v == &proc->vma[NMMAP])
+    return -1;
+  if((start = mmaproom(PGROUNDUP(len))) == 0)
+    return -1;
+  v->start = start;
+  v->end = start + PGROUNDUP(len);
+  v->off = off;
+  v->prot = prot;
+  v->f = filedup(f);
+  return start;
+}
+
+// Remove the region that starts at addr and is len bytes long.
+int
+sys_munmap(void)
+{
+  int addr, len;
+  struct vma *v;
+
+  if(argint(0, &addr) < 0 || argint(1, &len) < 0)
+    return -1;
+  if((v = mmapfind(addr)) == 0 || v->start != addr ||
+     v->end != v->start + PGROUNDUP(len))
+    return -1;
+  deallocuvm(proc->pgdir, v->end, v->start);
+  switchuvm(proc);
+  fileclose(v->f);
+  v->f = 0;
+  return 0;
+}
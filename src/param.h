@@ -2,13 +2,19 @@
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NFILE      1000  // open files per system
+#define NINODE     1000  // maximum number of active i-nodes
+#define NMMAP         8  // mmap regions per process
+#define NDENTRY    1024  // cached directory entries
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define MAXOPBLOCKS  20  // max # of blocks any FS op writes
+#define LOGSIZE      1024  // max data blocks in a transaction
+#define NLOG         1000  // blocks in on-disk log, unless mkfs -l says
+#define MAXLOG       4096  // max blocks in on-disk log
+#define NBUF         128  // min disk block cache buffers not pinned by the log
+#define NRUN         16  // max buffers readi/writei hold at once
+#define RAMAX        32  // max blocks of sequential read-ahead per file
+#define FSSIZE       4000  // default file system size in blocks (mkfs -s)
 
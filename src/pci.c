@@ -0,0 +1,70 @@
+// PCI configuration space, through configuration mechanism #1.
+//
+// A PCI function is named by a tag: bus<<16 | device<<11 | function<<8.
+// Drivers find their device with pcifind() or pcifindclass()
+// and then read and write its configuration registers.
+
+#include "types.h"
+#include "defs.h"
+#include "x86.h"
+
+#define PCI_CONFADDR  0xCF8
+#define PCI_CONFDATA  0xCFC
+
+#define PCI_ID        0x00  // vendor and device ID
+#define PCI_CLASS     0x08  // class, subclass, prog-if, revision
+#define PCI_HEADER    0x0C  // header type in bits 16-23
+
+uint
+pciread(uint tag, int reg)
+{
+  outl(PCI_CONFADDR, 0x80000000 | tag | (reg & 0xFC));
+  return inl(PCI_CONFDATA);
+}
+
+void
+pciwrite(uint tag, int reg, uint v)
+{
+  outl(PCI_CONFADDR, 0x80000000 | tag | (reg & 0xFC));
+  outl(PCI_CONFDATA, v);
+}
+
+// Find the first function whose register reg, masked
+// with mask, equals val.  Returns 0 and sets *tag if found.
+static int
+pciscan(int reg, uint mask, uint val, uint *tag)
+{
+  uint bus, dev, fn, nfn, t;
+
+  for(bus = 0; bus < 256; bus++){
+    for(dev = 0; dev < 32; dev++){
+      nfn = 1;
+      for(fn = 0; fn < nfn; fn++){
+        t = bus<<16 | dev<<11 | fn<<8;
+        if((pciread(t, PCI_ID) & 0xFFFF) == 0xFFFF)
+          continue;
+        if(fn == 0 && (pciread(t, PCI_HEADER) & 0x800000))
+          nfn = 8;  // multi-function device
+        if((pciread(t, reg) & mask) == val){
+          *tag = t;
+          return 0;
+        }
+      }
+    }
+  }
+  return -1;
+}
+
+// Find a device by vendor and device ID.
+int
+pcifind(uint vendor, uint device, uint *tag)
+{
+  return pciscan(PCI_ID, 0xFFFFFFFF, device<<16 | vendor, tag);
+}
+
+// Find a device by class and subclass.
+int
+pcifindclass(uint class, uint subclass, uint *tag)
+{
+  return pciscan(PCI_CLASS, 0xFFFF0000, class<<24 | subclass<<16, tag);
+}
@@ -171,6 +171,13 @@ int fork(int tickets)
     release(&ptable.lock);
     return -1;
   }
+  if(mmapfork(np) < 0){
+    freevm(np->pgdir);
+    kfree(np->kstack);
+    np->kstack = 0;
+    np->state = UNUSED;
+    return -1;
+  }
   np->sz = proc->sz;
   np->parent = proc;
   *np->tf = *proc->tf;
@@ -228,6 +235,7 @@ exit(void)
       proc->ofile[fd] = 0;
     }
   }
+  mmapclose(proc);
 
   begin_op();
   iput(proc->cwd);
@@ -338,7 +346,13 @@ scheduler(void)
 		else
 			seed++;
 	}else
-		count++:
+		count++;
+
+	if(maxTicket == 0){
+		// Nothing to run: use the idle time to zero free pages.
+		kzeroidle();
+		continue;
+	}
 
 	Initialize(seed);
 	
@@ -355,6 +369,12 @@ scheduler(void)
 					break;
 			}
 		}
+		// The winner may have stopped being runnable
+		// since ticketCount() looked at it.
+		if(p == &ptable.proc[NPROC]){
+			release(&ptable.lock);
+			continue;
+		}
 	
 		
 		// Switch to chosen process.  It is the process's job
@@ -426,7 +446,6 @@ forkret(void)
     // be run from main().
     first = 0;
     iinit(ROOTDEV);
-    initlog(ROOTDEV);
   }
 
   // Return to "caller", actually trapret (see allocproc).
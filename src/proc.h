@@ -48,6 +48,15 @@ struct context {
 
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A region of memory mapped from a file by mmap().
+struct vma {
+  uint start;                  // First address
+  uint end;                    // Address just past the region
+  struct file *f;              // File mapped, or 0 if the slot is free
+  uint off;                    // Offset in f of start
+  int prot;                    // PROT_READ, PROT_WRITE
+};
+
 // Per-process state
 struct proc {
   uint sz;                     // Size of process memory (bytes)
@@ -64,6 +73,9 @@ struct proc {
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
   int tickets;		       // Variable to inform number of tickets for each program
+  int logres;                  // Log blocks reserved by begin_op()
+  int logused;                 // Of those, blocks log_write() has added
+  struct vma vma[NMMAP];       // mmap regions
 };
 
 void Initialize(unsigned int);
@@ -77,3 +89,4 @@ unsigned int Extract(void);
 //   original data and bss
 //   fixed-size stack
 //   expandable heap
+// with mmap regions between MMAPBASE and KERNBASE.
@@ -0,0 +1,228 @@
+// Slab allocator for kernel objects smaller than a page.
+//
+// Each object cache (struct kmem_cache) hands out objects of a
+// single size.  Objects are carved out of slabs: whole pages
+// obtained from kalloc(), with a struct slab header at the start
+// of the page followed by as many objects as fit.  Because a slab
+// is exactly one page, kmem_cache_free() finds an object's slab by
+// rounding its address down to a page boundary.
+//
+// Each CPU keeps a small stack of free objects per cache, so that
+// most allocations and frees touch only per-CPU state with
+// interrupts disabled and never take the cache lock.  When a CPU's
+// stack runs empty it refills half of it from the slabs; when it
+// fills up it gives half back.
+//
+// Interface:
+// * kmem_cache_create(name, size) makes a new cache.
+// * kmem_cache_alloc(c) returns an object, or 0 if out of memory.
+// * kmem_cache_free(c, obj) returns obj to its cache.
+// Objects are not zeroed.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+
+#define NCPUOBJ 16  // free objects held per CPU per cache
+
+struct run {
+  struct run *next;
+};
+
+struct slab {
+  struct slab *prev;         // partial list
+  struct slab *next;
+  struct kmem_cache *cache;
+  int inuse;                 // objects handed out of this slab
+  struct run *freelist;
+};
+
+struct kmem_cpucache {
+  int n;
+  void *obj[NCPUOBJ];
+};
+
+struct kmem_cache {
+  struct spinlock lock;
+  char *name;
+  uint size;                 // object size, rounded up
+  uint perslab;              // objects per slab
+  struct slab *partial;      // slabs with at least one free object
+  struct kmem_cpucache cpu[NCPU];
+};
+
+#define SLABHDR ((sizeof(struct slab) + 7) & ~7)
+
+// The cache from which all other caches are allocated.
+static struct kmem_cache cache_cache;
+
+static void
+cacheinit(struct kmem_cache *c, char *name, uint size)
+{
+  size = (size + 7) & ~7;
+  if(size < sizeof(struct run))
+    size = sizeof(struct run);
+  if(size > PGSIZE - SLABHDR)
+    panic("kmem_cache_create: object too big");
+  memset(c, 0, sizeof(*c));
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - SLABHDR) / size;
+}
+
+void
+slabinit(void)
+{
+  cacheinit(&cache_cache, "kmem_cache", sizeof(struct kmem_cache));
+}
+
+// Create a cache of objects of the given size.
+// Returns 0 if out of memory.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  if((c = kmem_cache_alloc(&cache_cache)) == 0)
+    return 0;
+  cacheinit(c, name, size);
+  return c;
+}
+
+static void
+unlink(struct kmem_cache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+  s->prev = s->next = 0;
+}
+
+static void
+push(struct kmem_cache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+// Allocate a page for a new slab and put it on the partial list.
+// Caller must hold c->lock.
+static struct slab*
+grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  struct run *r;
+  char *p;
+  int i;
+
+  if((p = kalloc()) == 0)
+    return 0;
+  s = (struct slab*)p;
+  s->cache = c;
+  s->inuse = 0;
+  s->freelist = 0;
+  for(i = c->perslab - 1; i >= 0; i--){
+    r = (struct run*)(p + SLABHDR + i*c->size);
+    r->next = s->freelist;
+    s->freelist = r;
+  }
+  push(c, s);
+  return s;
+}
+
+// Move up to half of NCPUOBJ objects from the slabs into cc.
+// Caller must have interrupts disabled.
+static void
+refill(struct kmem_cache *c, struct kmem_cpucache *cc)
+{
+  struct slab *s;
+  struct run *r;
+
+  acquire(&c->lock);
+  while(cc->n < NCPUOBJ/2){
+    if((s = c->partial) == 0 && (s = grow(c)) == 0)
+      break;
+    r = s->freelist;
+    s->freelist = r->next;
+    s->inuse++;
+    if(s->freelist == 0)
+      unlink(c, s);
+    cc->obj[cc->n++] = r;
+  }
+  release(&c->lock);
+}
+
+// Return half of the objects in cc to their slabs.
+// Empty slabs go back to kalloc, except for the last
+// partial slab, which is kept to absorb the next refill.
+// Caller must have interrupts disabled.
+static void
+flush(struct kmem_cache *c, struct kmem_cpucache *cc)
+{
+  struct slab *s;
+  struct run *r;
+
+  acquire(&c->lock);
+  while(cc->n > NCPUOBJ/2){
+    r = cc->obj[--cc->n];
+    s = (struct slab*)PGROUNDDOWN((uint)r);
+    if(s->cache != c)
+      panic("kmem_cache_free: wrong cache");
+    if(s->freelist == 0)
+      push(c, s);
+    r->next = s->freelist;
+    s->freelist = r;
+    if(--s->inuse == 0 && (s->prev || s->next)){
+      unlink(c, s);
+      kfree((char*)s);
+    }
+  }
+  release(&c->lock);
+}
+
+// Allocate an object from cache c.
+// Returns 0 if the memory cannot be allocated.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct kmem_cpucache *cc;
+  void *obj;
+
+  pushcli();
+  cc = &c->cpu[cpu - cpus];
+  if(cc->n == 0)
+    refill(c, cc);
+  obj = 0;
+  if(cc->n > 0)
+    obj = cc->obj[--cc->n];
+  popcli();
+  return obj;
+}
+
+// Free an object previously returned by kmem_cache_alloc(c).
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct kmem_cpucache *cc;
+
+  if((uint)obj % 8 || (char*)obj < (char*)PGROUNDDOWN((uint)obj) + SLABHDR)
+    panic("kmem_cache_free");
+
+  pushcli();
+  cc = &c->cpu[cpu - cpus];
+  if(cc->n == NCPUOBJ)
+    flush(c, cc);
+  cc->obj[cc->n++] = obj;
+  popcli();
+}
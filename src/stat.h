@@ -9,3 +9,13 @@ struct stat {
   short nlink; // Number of links to file
   uint size;   // Size of file in bytes
 };
+
+// Buffer cache statistics, from bcstat().
+struct bcstat {
+  uint nbuf;      // Number of buffers
+  uint nin;       // Buffers on the in queue (seen once)
+  uint nmain;     // Buffers on the main queue (reused)
+  uint hits;      // Lookups that found the block cached
+  uint misses;    // Lookups that had to recycle a buffer
+  uint ghosthits; // Misses on blocks evicted from the in queue
+};
@@ -48,6 +48,16 @@ argint(int n, int *ip)
   return fetchint(proc->tf->esp + 4 + 4*n, ip);
 }
 
+// Check that the size bytes at i lie within the process's memory
+// or in one mmap region, which must be writable if write is set.
+static int
+checkptr(uint i, int size, int write)
+{
+  if(i < proc->sz && i+size <= proc->sz)
+    return 0;
+  return mmapcheck(i, size, write);
+}
+
 // Fetch the nth word-sized system call argument as a pointer
 // to a block of memory of size n bytes.  Check that the pointer
 // lies within the process address space.
@@ -58,7 +68,22 @@ argptr(int n, char **pp, int size)
 
   if(argint(n, &i) < 0)
     return -1;
-  if((uint)i >= proc->sz || (uint)i+size > proc->sz)
+  if(checkptr(i, size, 1) < 0)
+    return -1;
+  *pp = (char*)i;
+  return 0;
+}
+
+// Like argptr, for memory the kernel will only read,
+// which may be a read-only mmap region.
+int
+argrptr(int n, char **pp, int size)
+{
+  int i;
+
+  if(argint(n, &i) < 0)
+    return -1;
+  if(checkptr(i, size, 0) < 0)
     return -1;
   *pp = (char*)i;
   return 0;
@@ -98,6 +123,9 @@ extern int sys_unlink(void);
 extern int sys_wait(void);
 extern int sys_write(void);
 extern int sys_uptime(void);
+extern int sys_bcstat(void);
+extern int sys_mmap(void);
+extern int sys_munmap(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -121,6 +149,9 @@ static int (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_bcstat]  sys_bcstat,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
 };
 
 void
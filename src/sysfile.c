@@ -82,7 +82,7 @@ sys_write(void)
   int n;
   char *p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argrptr(1, &p, n) < 0)
     return -1;
   return filewrite(f, p, n);
 }
@@ -111,6 +111,17 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+int
+sys_bcstat(void)
+{
+  struct bcstat *st;
+
+  if(argptr(0, (void*)&st, sizeof(*st)) < 0)
+    return -1;
+  bstat(st);
+  return 0;
+}
+
 // Create the path new as a link to the same inode as old.
 int
 sys_link(void)
@@ -182,7 +193,6 @@ int
 sys_unlink(void)
 {
   struct inode *ip, *dp;
-  struct dirent de;
   char name[DIRSIZ], *path;
   uint off;
 
@@ -212,9 +222,7 @@ sys_unlink(void)
     goto bad;
   }
 
-  memset(&de, 0, sizeof(de));
-  if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
-    panic("unlink: writei");
+  dirunlink(dp, name, off);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -238,7 +246,6 @@ bad:
 static struct inode*
 create(char *path, short type, short major, short minor)
 {
-  uint off;
   struct inode *ip, *dp;
   char name[DIRSIZ];
 
@@ -246,7 +253,7 @@ create(char *path, short type, short major, short minor)
     return 0;
   ilock(dp);
 
-  if((ip = dirlookup(dp, name, &off)) != 0){
+  if((ip = dirlookup(dp, name, 0)) != 0){
     iunlockput(dp);
     ilock(ip);
     if(type == T_FILE && ip->type == T_FILE)
@@ -272,8 +279,18 @@ create(char *path, short type, short major, short minor)
       panic("create dots");
   }
 
-  if(dirlink(dp, name, ip->inum) < 0)
-    panic("create: dirlink");
+  if(dirlink(dp, name, ip->inum) < 0){
+    // dp is full: free ip again.
+    if(type == T_DIR){
+      dp->nlink--;
+      iupdate(dp);
+    }
+    ip->nlink = 0;
+    iupdate(ip);
+    iunlockput(dp);  // before ip's truncate can restart the op
+    iunlockput(ip);
+    return 0;
+  }
 
   iunlockput(dp);
 
@@ -36,6 +36,8 @@ idtinit(void)
 void
 trap(struct trapframe *tf)
 {
+  uint va;
+
   if(tf->trapno == T_SYSCALL){
     if(proc->killed)
       exit();
@@ -78,8 +80,25 @@ trap(struct trapframe *tf)
     lapiceoi();
     break;
 
+  case T_PGFLT:
+    // Fill in a page of an mmap region on first touch.
+    // Like a system call, this may sleep reading the file,
+    // so let interrupts in, once cr2 is safe.
+    if(proc && (tf->cs&3) == DPL_USER){
+      va = rcr2();
+      sti();
+      if(mmapfault(va, tf->err & FEC_WR) == 0)
+        break;
+    }
+    // fall through
+
   //PAGEBREAK: 13
   default:
+    if(virtioirq && tf->trapno == T_IRQ0 + virtioirq){
+      virtiointr();
+      lapiceoi();
+      break;
+    }
     if(proc == 0 || (tf->cs&3) == 0){
       // In kernel, it must be our mistake.
       cprintf("unexpected trap %d from cpu %d eip %x (cr2=0x%x)\n",
@@ -1,4 +1,5 @@
 struct stat;
+struct bcstat;
 struct rtcdate;
 
 // system calls
@@ -23,6 +24,9 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int bcstat(struct bcstat*);
+void* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
 
 // ulib.c
 int stat(char*, struct stat*);
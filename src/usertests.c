@@ -184,6 +184,8 @@ writetest(void)
   printf(stdout, "small file test ok\n");
 }
 
+#define BIGBLOCKS 400  // size of the big file, in blocks
+
 void
 writetest1(void)
 {
@@ -197,7 +199,7 @@ writetest1(void)
     exit();
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < BIGBLOCKS; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, 512) != 512){
       printf(stdout, "error: write big file failed\n", i);
@@ -217,7 +219,7 @@ writetest1(void)
   for(;;){
     i = read(fd, buf, 512);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != BIGBLOCKS){
         printf(stdout, "read only %d blocks from big", n);
         exit();
       }
@@ -241,6 +243,103 @@ writetest1(void)
   printf(stdout, "big files ok\n");
 }
 
+// mmap a file, read it in place, write to the private copy,
+// and check that neither the file nor a child sees the other's writes.
+void
+mmaptest(void)
+{
+  int i, m, fd, pid, n;
+  char *p;
+
+  printf(stdout, "mmap test\n");
+
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "error: creat mmapfile failed!\n");
+    exit();
+  }
+  n = 3*4096 + 100;
+  for(i = 0; i < n; i += 4096){
+    for(m = 0; m < 4096; m += sizeof(int))
+      *(int*)(buf + m) = i + m;
+    m = n - i < 4096 ? n - i : 4096;
+    if(write(fd, buf, m) != m){
+      printf(stdout, "error: write mmapfile failed\n");
+      exit();
+    }
+  }
+
+  if(mmap(0, n, PROT_READ, MAP_PRIVATE, fd, 1) != (char*)-1){
+    printf(stdout, "mmap at unaligned offset succeeded!\n");
+    exit();
+  }
+  p = mmap(0, n, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(p == (char*)-1){
+    printf(stdout, "mmap failed\n");
+    exit();
+  }
+  for(i = 0; i < n; i += sizeof(int)){
+    if(*(int*)(p + i) != i){
+      printf(stdout, "mmap content at %d is %d\n", i, *(int*)(p + i));
+      exit();
+    }
+  }
+  for(i = n; i < 4*4096; i++){
+    if(p[i] != 0){
+      printf(stdout, "mmap past end of file not zero\n");
+      exit();
+    }
+  }
+
+  // Pass mapped memory to system calls.
+  fd = open("mmapcopy", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, p, n) != n){
+    printf(stdout, "write from mmap failed\n");
+    exit();
+  }
+  close(fd);
+  fd = open("mmapcopy", O_RDONLY);
+  *(int*)p = -1;
+  if(read(fd, p, 4096) != 4096 || *(int*)p != 0){
+    printf(stdout, "read into mmap failed\n");
+    exit();
+  }
+  close(fd);
+  unlink("mmapcopy");
+
+  p[4096] = 'x';
+  pid = fork(0);
+  if(pid < 0){
+    printf(stdout, "fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    if(p[4096] != 'x' || *(int*)(p + 2*4096) != 2*4096)
+      printf(stdout, "mmap not copied to child\n");
+    p[4096] = 'y';
+    exit();
+  }
+  wait();
+  if(p[4096] != 'x'){
+    printf(stdout, "child's write to mmap seen by parent\n");
+    exit();
+  }
+  if(munmap(p, n) < 0){
+    printf(stdout, "munmap failed\n");
+    exit();
+  }
+
+  fd = open("mmapfile", O_RDONLY);
+  if(read(fd, buf, 4096+4) != 4096+4 || *(int*)(buf + 4096) != 4096){
+    printf(stdout, "write to private mmap reached the file\n");
+    exit();
+  }
+  close(fd);
+  unlink("mmapfile");
+  printf(stdout, "mmap test ok\n");
+}
+
 void
 createtest(void)
 {
@@ -1759,6 +1858,7 @@ main(int argc, char *argv[])
   opentest();
   writetest();
   writetest1();
+  mmaptest();
   createtest();
 
   openiputtest();
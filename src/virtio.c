@@ -0,0 +1,262 @@
+// Driver for a virtio block device, through the legacy
+// virtio PCI interface.  If one is present at boot, it
+// takes the place of IDE disk 1.
+//
+// Requests go on a single virtqueue.  Each is a chain of
+// three descriptors: a header with the operation and sector,
+// the buf's data, and a status byte that the device fills in.
+// Many bufs can be in flight at once, and one interrupt
+// completes every request the device has finished.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "fs.h"
+#include "buf.h"
+
+#define VIRTIO_VENDOR     0x1AF4
+#define VIRTIO_BLK        0x1001
+
+// Legacy registers, in I/O space at BAR0.
+#define VIRTIO_HOSTFEAT   0x00
+#define VIRTIO_GUESTFEAT  0x04
+#define VIRTIO_QADDR      0x08  // physical page number of the queue
+#define VIRTIO_QSIZE      0x0C
+#define VIRTIO_QSEL       0x0E
+#define VIRTIO_QNOTIFY    0x10
+#define VIRTIO_STATUS     0x12
+#define VIRTIO_ISR        0x13
+
+#define VIRTIO_ACK        1
+#define VIRTIO_DRIVER     2
+#define VIRTIO_DRIVER_OK  4
+
+#define VRING_NEXT        1  // descriptor continues in next
+#define VRING_WRITE       2  // device writes the buffer
+
+#define VIRTIO_BLK_IN     0  // read
+#define VIRTIO_BLK_OUT    1  // write
+
+#define NDESC 256  // largest queue that fits in vqmem
+
+struct vring_desc {
+  uint addr;
+  uint addrhi;
+  uint len;
+  ushort flags;
+  ushort next;
+};
+
+struct vring_avail {
+  ushort flags;
+  ushort idx;
+  ushort ring[];
+};
+
+struct vring_used_elem {
+  uint id;  // head of the finished chain
+  uint len;
+};
+
+struct vring_used {
+  ushort flags;
+  ushort idx;
+  struct vring_used_elem ring[];
+};
+
+struct blkreq {
+  uint type;
+  uint reserved;
+  uint sector;
+  uint sectorhi;
+};
+
+// The queue: descriptors and available ring, then the used
+// ring starting on a page boundary.  The device reads it by
+// physical address, so it lives in the kernel image.
+static char vqmem[3*PGSIZE] __attribute__((__aligned__(PGSIZE)));
+
+int virtioirq;
+
+static struct {
+  struct spinlock lock;
+  ushort port;
+  int n;                          // queue size
+  struct vring_desc *desc;
+  struct vring_avail *avail;
+  volatile struct vring_used *used;
+  int free;                       // free descriptors, chained by next
+  int nfree;
+  ushort usedidx;                 // used ring entries seen so far
+
+  // Per request, indexed by the head descriptor.
+  struct {
+    struct blkreq hdr;
+    uchar status;
+    struct buf *b;
+  } req[NDESC];
+} vdisk;
+
+// Look for a virtio block device and set it up.
+// Returns 0 on success, -1 if there is none.
+int
+virtioinit(void)
+{
+  uint tag, bar, irq;
+  int i, n;
+
+  if(pcifind(VIRTIO_VENDOR, VIRTIO_BLK, &tag) < 0)
+    return -1;
+  bar = pciread(tag, 0x10);
+  irq = pciread(tag, 0x3C) & 0xFF;
+  if(!(bar & 1) || irq == 0 || irq >= 16)
+    return -1;
+  pciwrite(tag, 0x04, (pciread(tag, 0x04) & 0xFFFF) | 0x5);
+
+  initlock(&vdisk.lock, "virtio");
+  vdisk.port = bar & 0xFFFC;
+  outb(vdisk.port+VIRTIO_STATUS, 0);
+  outb(vdisk.port+VIRTIO_STATUS, VIRTIO_ACK);
+  outb(vdisk.port+VIRTIO_STATUS, VIRTIO_ACK|VIRTIO_DRIVER);
+  outl(vdisk.port+VIRTIO_GUESTFEAT, 0);
+
+  outw(vdisk.port+VIRTIO_QSEL, 0);
+  n = inw(vdisk.port+VIRTIO_QSIZE);
+  if(n == 0 || n > NDESC){
+    outb(vdisk.port+VIRTIO_STATUS, 0);
+    return -1;
+  }
+  vdisk.n = n;
+  vdisk.desc = (struct vring_desc*)vqmem;
+  vdisk.avail = (struct vring_avail*)(vqmem + n*sizeof(struct vring_desc));
+  vdisk.used = (struct vring_used*)
+    PGROUNDUP((uint)&vdisk.avail->ring[n] + sizeof(ushort));
+  for(i = 0; i < n; i++)
+    vdisk.desc[i].next = i + 1;
+  vdisk.free = 0;
+  vdisk.nfree = n;
+  outl(vdisk.port+VIRTIO_QADDR, V2P(vqmem) >> PGSHIFT);
+  outb(vdisk.port+VIRTIO_STATUS, VIRTIO_ACK|VIRTIO_DRIVER|VIRTIO_DRIVER_OK);
+
+  virtioirq = irq;
+  picenable(irq);
+  ioapicenable(irq, ncpu - 1);
+  return 0;
+}
+
+static int
+allocdesc(void)
+{
+  int i;
+
+  i = vdisk.free;
+  vdisk.free = vdisk.desc[i].next;
+  vdisk.nfree--;
+  return i;
+}
+
+static void
+freechain(int i)
+{
+  int next;
+
+  for(;;){
+    next = vdisk.desc[i].next;
+    vdisk.desc[i].next = vdisk.free;
+    vdisk.free = i;
+    vdisk.nfree++;
+    if(!(vdisk.desc[i].flags & VRING_NEXT))
+      break;
+    i = next;
+  }
+}
+
+static void
+setdesc(int i, void *a, uint len, int flags, int next)
+{
+  vdisk.desc[i].addr = V2P(a);
+  vdisk.desc[i].addrhi = 0;
+  vdisk.desc[i].len = len;
+  vdisk.desc[i].flags = flags;
+  vdisk.desc[i].next = next;
+}
+
+// Put a request for b on the available ring.
+// Caller must hold vdisk.lock, and there must be
+// three free descriptors.
+static void
+addreq(struct buf *b)
+{
+  int d0, d1, d2;
+  int write;
+
+  write = (b->flags & B_DIRTY) != 0;
+  d0 = allocdesc();
+  d1 = allocdesc();
+  d2 = allocdesc();
+  vdisk.req[d0].hdr.type = write ? VIRTIO_BLK_OUT : VIRTIO_BLK_IN;
+  vdisk.req[d0].hdr.reserved = 0;
+  vdisk.req[d0].hdr.sector = b->blockno * (BSIZE/512);
+  vdisk.req[d0].hdr.sectorhi = 0;
+  vdisk.req[d0].status = 0xff;
+  vdisk.req[d0].b = b;
+  setdesc(d0, &vdisk.req[d0].hdr, sizeof(struct blkreq), VRING_NEXT, d1);
+  setdesc(d1, b->data, BSIZE, VRING_NEXT | (write ? 0 : VRING_WRITE), d2);
+  setdesc(d2, &vdisk.req[d0].status, 1, VRING_WRITE, 0);
+
+  vdisk.avail->ring[vdisk.avail->idx % vdisk.n] = d0;
+  __sync_synchronize();
+  vdisk.avail->idx++;
+}
+
+// Start I/O on bufs, as idesubmit() does.  The whole batch
+// is announced to the device with one notification, unless
+// the queue fills up.
+void
+virtiosubmit(struct buf **bufs, int n)
+{
+  int i;
+
+  acquire(&vdisk.lock);
+  for(i = 0; i < n; i++){
+    while(vdisk.nfree < 3){
+      outw(vdisk.port+VIRTIO_QNOTIFY, 0);
+      sleep(&vdisk.nfree, &vdisk.lock);
+    }
+    addreq(bufs[i]);
+  }
+  __sync_synchronize();
+  outw(vdisk.port+VIRTIO_QNOTIFY, 0);
+  release(&vdisk.lock);
+}
+
+// Interrupt handler.
+void
+virtiointr(void)
+{
+  struct buf *b;
+  int id;
+
+  acquire(&vdisk.lock);
+  inb(vdisk.port+VIRTIO_ISR);  // acknowledge
+
+  while(vdisk.usedidx != vdisk.used->idx){
+    __sync_synchronize();
+    id = vdisk.used->ring[vdisk.usedidx % vdisk.n].id;
+    if(vdisk.req[id].status != 0)
+      panic("virtiointr: I/O error");
+    b = vdisk.req[id].b;
+    freechain(id);
+    vdisk.usedidx++;
+
+    biodone(b);
+  }
+  wakeup(&vdisk.nfree);
+
+  release(&vdisk.lock);
+}
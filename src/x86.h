@@ -9,6 +9,24 @@ inb(ushort port)
   return data;
 }
 
+static inline ushort
+inw(ushort port)
+{
+  ushort data;
+
+  asm volatile("in %1,%0" : "=a" (data) : "d" (port));
+  return data;
+}
+
+static inline uint
+inl(ushort port)
+{
+  uint data;
+
+  asm volatile("in %1,%0" : "=a" (data) : "d" (port));
+  return data;
+}
+
 static inline void
 insl(int port, void *addr, int cnt)
 {
@@ -30,6 +48,12 @@ outw(ushort port, ushort data)
   asm volatile("out %0,%1" : : "a" (data), "d" (port));
 }
 
+static inline void
+outl(ushort port, uint data)
+{
+  asm volatile("out %0,%1" : : "a" (data), "d" (port));
+}
+
 static inline void
 outsl(int port, const void *addr, int cnt)
 {
@@ -130,6 +154,16 @@ xchg(volatile uint *addr, uint newval)
   return result;
 }
 
+// Index of the lowest set bit in x, which must not be 0.
+static inline uint
+bsf(uint x)
+{
+  uint i;
+
+  asm volatile("bsf %1,%0" : "=r" (i) : "rm" (x) : "cc");
+  return i;
+}
+
 static inline uint
 rcr2(void)
 {